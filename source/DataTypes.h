@@ -1,6 +1,7 @@
 #pragma once
 #include "Math.h"
 #include "vector"
+#include <cstdint>
 
 namespace dae
 {
@@ -24,19 +25,208 @@ namespace dae
 		//Vector3 viewDirection{};
 	};
 
+	//Vertex attributes as separate streams, so 8 vertices fit in one AVX register per component
+	struct VertexStreams
+	{
+		std::vector<float> positionX{};
+		std::vector<float> positionY{};
+		std::vector<float> positionZ{};
+		std::vector<float> positionW{}; //Only filled for transformed vertices
+		std::vector<float> normalX{};
+		std::vector<float> normalY{};
+		std::vector<float> normalZ{};
+		std::vector<float> tangentX{};
+		std::vector<float> tangentY{};
+		std::vector<float> tangentZ{};
+	};
+
+	//A small cluster of a triangle list mesh, culled as a whole before any of its vertices get transformed
+	//Its vertices are a range of their own in the mesh, so only the vertices of meshlets that survive culling get transformed
+	struct Meshlet
+	{
+		uint32_t vertexOffset{};
+		uint32_t vertexCount{};
+		uint32_t indexOffset{};
+		uint32_t indexCount{};
+
+		//Object space bounding sphere
+		Vector3 center{};
+		float radius{};
+
+		//Object space normal cone, the meshlet faces away from every point p for which Dot((coneApex - p).Normalized(), coneAxis) >= coneCutoff
+		//A cutoff above 1 never culls, for meshlets whose triangles face too many directions
+		Vector3 coneApex{};
+		Vector3 coneAxis{};
+		float coneCutoff{ 2.f };
+	};
+
+	//Versions of the matrices the outputs of a range of vertices were transformed with, version 0 was never transformed
+	struct TransformVersion
+	{
+		uint32_t positions{};
+		uint32_t directions{};
+	};
+
+	//What the vertex stage has to redo for a range of vertices, the rest of its outputs is still valid in the transform cache
+	struct TransformWork
+	{
+		bool isPositions{ true };
+		bool isDirections{ true };
+
+		bool operator==(const TransformWork& work) const = default;
+	};
+
+	struct MeshletWork
+	{
+		uint32_t meshlet{};
+		TransformWork work{};
+	};
+
 	enum class PrimitiveTopology
 	{
 		TriangeList,
 		TriangleStrip
 	};
 
+	//Which side of the triangles gets discarded, front faces are clockwise on screen
+	enum class CullMode
+	{
+		None,
+		Back,
+		Front
+	};
+
 	struct Mesh
 	{
 		std::vector<Vertex> vertices{};
 		std::vector<uint32_t> indices{};
 		PrimitiveTopology primitiveTopology{ PrimitiveTopology::TriangleStrip };
+		CullMode cullMode{ CullMode::Back };
+		bool isCacheOptimized{ false }; //Triangles and vertices get reordered for the post-transform cache, overdraw and vertex fetch when the mesh is loaded
+
+		//Object space bounding box, tested against the occlusion buffer before any vertex gets transformed
+		Vector3 boundsMin{};
+		Vector3 boundsMax{};
+		bool isOccluder{ false }; //Rasterized into the occlusion buffer before the other meshes are tested
+
+		//Optional meshlets, covering all of the vertices and indices
+		std::vector<Meshlet> meshlets{};
+
+		//Optional structure of arrays copy of the vertices, when filled the vertex stage transforms them into vertex_streams_out instead of vertices_out
+		//Color and uv don't get transformed, they are still read from vertices
+		VertexStreams vertex_streams{};
+		VertexStreams vertex_streams_out{};
 
 		std::vector<Vertex_Out> vertices_out{};
+
+		//Transform cache, the vertex stage only redoes the outputs whose matrix changed since they were transformed
+		//Positions depend on the world view projection matrix, normals and tangents only on the world matrix, so moving the camera keeps them
+		//Every change of a matrix bumps its version, outputVersions holds the versions every meshlet, or the whole mesh, was last transformed with
+		Matrix cachedWorldMatrix{};
+		Matrix cachedWorldViewProjectionMatrix{};
+		TransformVersion version{ 1, 1 };
+		std::vector<TransformVersion> outputVersions{};
+	};
+
+	//One entry of the per-frame draw list, it only points at the mesh so drawing never copies any vertices or indices
+	//The mesh's output buffers are scratch space for the vertex stage, draws are processed one after the other so a mesh can be drawn more than once
+	struct DrawCall
+	{
+		Mesh* pMesh{ nullptr };
 		Matrix worldMatrix{};
 	};
+
+	//Edge function in 28.4 fixed point, evaluated at pixel centers
+	struct EdgeFunction
+	{
+		int64_t origin{}; //Value at pixel (0, 0), fill rule bias included
+		int64_t stepX{}; //Increment for one pixel to the right
+		int64_t stepY{}; //Increment for one pixel down
+
+		int64_t At(int px, int py) const
+		{
+			return origin + px * stepX + py * stepY;
+		}
+
+		//Edge functions are linear, so their extremes over a rect of pixels are found in its corners
+		int64_t Min(int left, int top, int right, int bottom) const
+		{
+			return origin + (stepX < 0 ? right : left) * stepX + (stepY < 0 ? bottom : top) * stepY;
+		}
+
+		int64_t Max(int left, int top, int right, int bottom) const
+		{
+			return origin + (stepX > 0 ? right : left) * stepX + (stepY > 0 ? bottom : top) * stepY;
+		}
+	};
+
+	//Value that is linear in screen space, relative to the top left of a triangle's bounding box
+	struct AttributePlane
+	{
+		float origin{};
+		float stepX{};
+		float stepY{};
+
+		float At(float dx, float dy) const
+		{
+			return origin + dx * stepX + dy * stepY;
+		}
+	};
+
+	struct TriangleSetup
+	{
+		//Projected depth of the vertices, it is linear in screen space
+		float z0{};
+		float z1{};
+		float z2{};
+
+		//Edge functions opposite of each vertex, they are 0 on the edge and positive inside
+		EdgeFunction edge0{};
+		EdgeFunction edge1{};
+		EdgeFunction edge2{};
+		int64_t area{}; //Doubled area in fixed point units
+		float invArea{}; //1 / (2 * area) in fixed point units, turns edge values into barycentric weights
+
+		//Conservative range of the depth values the triangle can produce
+		float minDepth{};
+		float maxDepth{};
+
+		//Bounding box in pixels, right and bottom are exclusive
+		int left{};
+		int top{};
+		int right{};
+		int bottom{};
+		bool isSmall{}; //Bounding box of only a few pixels, rasterized without block traversal
+
+		//Perspective correct attributes, every plane holds the attribute divided by w
+		AttributePlane invW{};
+		AttributePlane u{};
+		AttributePlane v{};
+		AttributePlane normal[3]{};
+		AttributePlane tangent[3]{};
+	};
+
+	//Tile of the coarse occlusion buffer, in the style of masked occlusion culling
+	//The reference layer bounds the depth of the whole tile, the working layer only that of the pixels in its coverage mask
+	struct OcclusionTile
+	{
+		float layerDepth{};
+		float workingDepth{};
+		uint32_t coverage[4]{}; //One bit per pixel in rows, for every MSAA sample
+
+		//Pixels of the working layer, only those with all of their samples covered
+		uint32_t GetCoverage() const
+		{
+			return coverage[0] & coverage[1] & coverage[2] & coverage[3];
+		}
+	};
+
+	//What is visible in a pixel, so it can be shaded after rasterization
+	struct VisibilityPixel
+	{
+		static constexpr uint32_t NoTriangle{ UINT32_MAX };
+
+		//The attributes are interpolated from the triangle's planes, so the triangle is all that is needed
+		uint32_t triangleIndex{ NoTriangle };
+	};
 }
\ No newline at end of file
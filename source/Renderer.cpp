@@ -1,45 +1,182 @@
 //External includes
 #include "SDL.h"
 #include "SDL_surface.h"
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 //Project includes
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <iostream>
+#include <thread>
 #include "Renderer.h"
 #include "Math.h"
 #include "Matrix.h"
 #include "Texture.h"
+#include "ThreadPool.h"
 #include "Utils.h"
 
 using namespace dae;
 
+//Functions using AVX2 are compiled for it on their own, so the rest of the renderer still runs on CPUs without it
+//MSVC allows the intrinsics of any instruction set anywhere, GCC and Clang need the target attribute
+#ifdef _MSC_VER
+#define AVX2_FUNCTION
+#else
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+
+//Checks if both the CPU and the OS support AVX2, the SIMD rasterizer falls back to scalar code otherwise
+static bool IsAVX2Supported()
+{
+#ifdef _MSC_VER
+	int info[4]{};
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+
+	//AVX support + OS saves the YMM registers
+	__cpuid(info, 1);
+	const bool hasOSXSAVE{ (info[2] & (1 << 27)) != 0 };
+	const bool hasAVX{ (info[2] & (1 << 28)) != 0 };
+	if (!hasOSXSAVE || !hasAVX || (_xgetbv(0) & 0x6) != 0x6) return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+//Averages every channel of 4 pixels over all of their samples, in 16 bits so the sum can't overflow
+//Samples are sampleStride pixels apart, SSE2 is always available on x64 so there is no need to check for it
+static __m128i ResolveSamples(const uint32_t* pColor, int sampleCount, int sampleStride)
+{
+	const __m128i zero{ _mm_setzero_si128() };
+	__m128i sumLow{ zero };
+	__m128i sumHigh{ zero };
+
+	for (int sample{}; sample < sampleCount; ++sample)
+	{
+		const __m128i colors{ _mm_load_si128((const __m128i*)(pColor + (sample * sampleStride))) };
+		sumLow = _mm_add_epi16(sumLow, _mm_unpacklo_epi8(colors, zero));
+		sumHigh = _mm_add_epi16(sumHigh, _mm_unpackhi_epi8(colors, zero));
+	}
+
+	//Sample counts are powers of 2, so the average is a rounded shift
+	int shift{};
+	while ((1 << shift) < sampleCount) ++shift;
+
+	const __m128i rounding{ _mm_set1_epi16(short(sampleCount / 2)) };
+	sumLow = _mm_srl_epi16(_mm_add_epi16(sumLow, rounding), _mm_cvtsi32_si128(shift));
+	sumHigh = _mm_srl_epi16(_mm_add_epi16(sumHigh, rounding), _mm_cvtsi32_si128(shift));
+
+	return _mm_packus_epi16(sumLow, sumHigh);
+}
+
+//Blends two 32 bit colors with a weight out of 256, two channels at a time in the 0xFF00FF lanes of a 32 bit integer
+static uint32_t LerpColor(uint32_t color0, uint32_t color1, uint32_t weight)
+{
+	const uint32_t redBlue0{ color0 & 0xFF00FF };
+	const uint32_t greenAlpha0{ (color0 >> 8) & 0xFF00FF };
+	const uint32_t redBlue1{ color1 & 0xFF00FF };
+	const uint32_t greenAlpha1{ (color1 >> 8) & 0xFF00FF };
+
+	const uint32_t redBlue{ ((redBlue0 * (256 - weight) + redBlue1 * weight) >> 8) & 0xFF00FF };
+	const uint32_t greenAlpha{ (greenAlpha0 * (256 - weight) + greenAlpha1 * weight) & 0xFF00FF00 };
+	return redBlue | greenAlpha;
+}
+
+//Transforms 8 vectors by the broadcast rows of a matrix, the same multiplies and adds as Matrix::TransformVector
+AVX2_FUNCTION static void TransformVectors(const __m256 (&matrix)[3][3], const float* pX, const float* pY, const float* pZ, float* pOutX, float* pOutY, float* pOutZ)
+{
+	const __m256 x{ _mm256_loadu_ps(pX) };
+	const __m256 y{ _mm256_loadu_ps(pY) };
+	const __m256 z{ _mm256_loadu_ps(pZ) };
+	float* pOut[3]{ pOutX, pOutY, pOutZ };
+	for (int column{}; column < 3; ++column)
+	{
+		const __m256 result{ _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(matrix[0][column], x), _mm256_mul_ps(matrix[1][column], y)), _mm256_mul_ps(matrix[2][column], z)) };
+		_mm256_storeu_ps(pOut[column], result);
+	}
+}
+
+//Only allocates when the streams grew
+static void ResizeVertexStreams(VertexStreams& streams, size_t count)
+{
+	std::vector<float>* pStreams[10]{ &streams.positionX, &streams.positionY, &streams.positionZ, &streams.positionW,
+		&streams.normalX, &streams.normalY, &streams.normalZ, &streams.tangentX, &streams.tangentY, &streams.tangentZ };
+	for (std::vector<float>* pStream : pStreams)
+	{
+		pStream->resize(count);
+	}
+}
+
 Renderer::Renderer(SDL_Window* pWindow) :
 	m_pWindow(pWindow)
 {
 	//Initialize
-	SDL_GetWindowSize(pWindow, &m_Width, &m_Height);
-	m_AspectRatio = m_Width / (float)m_Height;
+	SDL_GetWindowSize(pWindow, &m_WindowWidth, &m_WindowHeight);
+	m_AspectRatio = m_WindowWidth / (float)m_WindowHeight;
 
 	//Create Buffers
 	m_pFrontBuffer = SDL_GetWindowSurface(pWindow);
-	m_pBackBuffer = SDL_CreateRGBSurface(0, m_Width, m_Height, 32, 0, 0, 0, 0);
+	m_pBackBuffer = SDL_CreateRGBSurface(0, m_WindowWidth, m_WindowHeight, 32, 0, 0, 0, 0);
 	m_pBackBufferPixels = (uint32_t*)m_pBackBuffer->pixels;
+	m_pRenderTargetPixels = new uint32_t[m_WindowWidth * m_WindowHeight];
 	m_ClearColor = SDL_MapRGB(m_pBackBuffer->format,
 		static_cast<uint8_t>(100),
 		static_cast<uint8_t>(100),
 		static_cast<uint8_t>(100));
 
-	m_pDepthBufferPixels = new float[m_Width * m_Height];
+	//Everything below gets sized for the full resolution, the largest one that gets rendered
+	SetRenderResolution(m_WindowWidth, m_WindowHeight);
+
+	//Create Tiles
+	m_TileBins.resize(m_TileCountX * m_TileCountY);
+	m_TileStats.resize(m_TileCountX * m_TileCountY);
+
+	//Tiled buffers cover whole tiles, also the ones sticking out of the screen, with room for every sample
+	m_pColorBufferPixels = new uint32_t[m_TiledPixelCount * m_MaxSampleCount];
+	m_pDepthBufferPixels = new float[m_TiledPixelCount * m_MaxSampleCount];
+	m_pVisibilityBufferPixels = new VisibilityPixel[m_TiledPixelCount * m_MaxSampleCount];
+	std::fill_n(m_pColorBufferPixels, m_TiledPixelCount * m_MaxSampleCount, m_ClearColor);
+
+	//Create Hierarchical Depth Buffer
+	m_pBlockMinDepth = new float[m_BlockCountX * m_BlockCountY];
+	m_pBlockMaxDepth = new float[m_BlockCountX * m_BlockCountY];
+	m_pBlockDepthSamples = new uint16_t[m_BlockCountX * m_BlockCountY];
+	m_pTileMinDepth = new float[m_TileCountX * m_TileCountY];
+	m_pTileMaxDepth = new float[m_TileCountX * m_TileCountY];
+	m_pTileDepthBlocks = new uint8_t[m_TileCountX * m_TileCountY];
+
+	//Create Shading Rate Image
+	m_pShadingRates = new uint8_t[m_BlockCountX * m_BlockCountY];
+	std::fill_n(m_pShadingRates, m_BlockCountX * m_BlockCountY, uint8_t(1));
+
+	//Create Occlusion Buffer
+	m_OcclusionTiles.resize(m_OcclusionTileCountX * m_OcclusionTileCountY);
+
+	//Initialize Threads
+	SetThreadCount(std::thread::hardware_concurrency());
+
+	//Initialize SIMD
+	m_IsAVX2Supported = IsAVX2Supported();
+	m_IsSIMDEnabled = m_IsAVX2Supported;
 
 	//Initialize Camera
-	m_Camera.Initialize(m_Width / (float)m_Height, 45.f, { 0.f,0.f,0.f });
+	m_Camera.Initialize(m_AspectRatio, 45.f, { 0.f,0.f,0.f });
 
 	//Initialize Texture
 	m_pTexDiffuse =  Texture::LoadFromFile("Resources/vehicle_diffuse.png");
 	m_pTexNormal =	 Texture::LoadFromFile("Resources/vehicle_normal.png");
 	m_pTexGloss =	 Texture::LoadFromFile("Resources/vehicle_gloss.png");
 	m_pTexSpecular = Texture::LoadFromFile("Resources/vehicle_specular.png");
-	Utils::ParseOBJ("Resources/vehicle.obj", m_Mesh.vertices, m_Mesh.indices);
-	m_Mesh.primitiveTopology = PrimitiveTopology::TriangeList;
+	m_Mesh.isOccluder = true;
+	m_Mesh.isCacheOptimized = true;
+	LoadMesh(m_MeshFilename, m_Mesh);
 }
 
 Renderer::~Renderer()
@@ -48,13 +185,57 @@ Renderer::~Renderer()
 	delete m_pTexNormal;
 	delete m_pTexGloss;
 	delete m_pTexSpecular;
+	delete[] m_pRenderTargetPixels;
+	delete[] m_pColorBufferPixels;
 	delete[] m_pDepthBufferPixels;
+	delete[] m_pVisibilityBufferPixels;
+	delete[] m_pBlockMinDepth;
+	delete[] m_pBlockMaxDepth;
+	delete[] m_pBlockDepthSamples;
+	delete[] m_pTileMinDepth;
+	delete[] m_pTileMaxDepth;
+	delete[] m_pTileDepthBlocks;
+	delete[] m_pShadingRates;
+	delete m_pThreadPool;
+}
+
+void Renderer::LoadMesh(const std::string& filename, Mesh& mesh) const
+{
+	Utils::ParseOBJ(filename, mesh.vertices, mesh.indices);
+	mesh.primitiveTopology = PrimitiveTopology::TriangeList;
+
+	//Triangles in post-transform cache order, in clusters sorted from the outside in, vertices in the order the triangles use them
+	const float exportedACMR{ Utils::ComputeACMR(mesh.indices, mesh.vertices.size()) };
+	if (mesh.isCacheOptimized)
+	{
+		Utils::OptimizeVertexCache(mesh.indices, mesh.vertices.size());
+		Utils::OptimizeOverdraw(mesh.vertices, mesh.indices);
+		Utils::OptimizeVertexFetch(mesh.vertices, mesh.indices);
+	}
+
+	//Meshlets keep that triangle order, only vertices shared with an earlier meshlet get copied, so the ACMR is measured on what gets drawn
+	const size_t vertexCount{ mesh.vertices.size() };
+	Utils::BuildMeshlets(mesh.vertices, mesh.indices, mesh.meshlets);
+	std::cout << "Vertex cache ACMR: " << exportedACMR << " -> " << Utils::ComputeACMR(mesh.indices, mesh.vertices.size()) << std::endl;
+	std::cout << "Meshlets: " << mesh.meshlets.size() << ", " << mesh.vertices.size() << " vertices, " << mesh.vertices.size() - vertexCount << " of them copies" << std::endl;
+
+	Utils::ComputeBounds(mesh.vertices, mesh.boundsMin, mesh.boundsMax);
+	Utils::BuildVertexStreams(mesh.vertices, mesh.vertex_streams);
+
+	//Whatever the transform cache held belongs to the vertices of before
+	mesh.outputVersions.clear();
 }
 
 void Renderer::Update(Timer* pTimer)
 {
 	m_Camera.Update(pTimer);
 
+	//Only frames that actually got rendered say something about the cost of the render resolution
+	if (m_IsDynamicResolution && !m_IsLastFrameReused)
+	{
+		UpdateResolutionScale(pTimer->GetElapsed());
+	}
+
 	if (m_IsRotating)
 	{
 		m_Rotation += pTimer->GetElapsed();
@@ -65,11 +246,30 @@ void Renderer::Update(Timer* pTimer)
 
 void Renderer::Render()
 {
+	//Rotate mesh
+	Draw(m_Mesh, Matrix::CreateRotationY(m_Rotation) * Matrix::CreateTranslation(0.f, 0.f, 50.f));
+
+	//Nothing that affects the image changed, the back buffer still holds the last frame
+	m_IsLastFrameReused = !UpdateFrameState();
+	if (m_IsLastFrameReused)
+	{
+		m_DrawList.clear();
+		SDL_BlitSurface(m_pBackBuffer, 0, m_pFrontBuffer, 0);
+		SDL_UpdateWindowSurface(m_pWindow);
+		return;
+	}
+
 	//@START
 	//Lock BackBuffer
 	SDL_LockSurface(m_pBackBuffer);
-	std::fill_n(m_pDepthBufferPixels, m_Width * m_Height, FLT_MAX);
-	SDL_FillRect(m_pBackBuffer, NULL, m_ClearColor);
+	std::fill_n(m_pDepthBufferPixels, m_TiledPixelCount * m_SampleCount, FLT_MAX);
+	std::fill_n(m_pBlockMinDepth, m_BlockCountX * m_BlockCountY, FLT_MAX);
+	std::fill_n(m_pBlockMaxDepth, m_BlockCountX * m_BlockCountY, FLT_MAX);
+	std::fill_n(m_pBlockDepthSamples, m_BlockCountX * m_BlockCountY, uint16_t(0));
+	std::fill_n(m_pTileMinDepth, m_TileCountX * m_TileCountY, FLT_MAX);
+	std::fill_n(m_pTileMaxDepth, m_TileCountX * m_TileCountY, FLT_MAX);
+	std::fill_n(m_pTileDepthBlocks, m_TileCountX * m_TileCountY, uint8_t(0));
+	m_Stats = {};
 
 	//Define Mesh
 	//std::vector<Mesh> meshes_world
@@ -100,13 +300,15 @@ void Renderer::Render()
 	//	}
 	//};
 
-	//Rotate mesh
-	m_Mesh.worldMatrix = Matrix::CreateRotationY(m_Rotation) * Matrix::CreateTranslation(0.f, 0.f, 50.f);
-
-	VertexTransformationFunction({m_Mesh});
-
 	//RENDER LOGIC
-	RenderMeshes({m_Mesh});
+	UpdateShadingRates();
+	RenderDrawList();
+	m_DrawList.clear();
+	ResolveColorBuffer();
+	if (m_pResolvePixels != m_pBackBufferPixels)
+	{
+		UpscaleRenderTarget();
+	}
 
 	//@END
 	//Update SDL Surface
@@ -115,299 +317,2314 @@ void Renderer::Render()
 	SDL_UpdateWindowSurface(m_pWindow);
 }
 
-void Renderer::RenderMeshes(const std::vector<Mesh>& meshes)
+bool Renderer::UpdateFrameState()
 {
-	for (const Mesh& m : meshes)
-	{
-		switch (m.primitiveTopology)
-		{
-		case PrimitiveTopology::TriangeList:
-			for (int i{}; i < m.indices.size() - 2; i += 3)
-			{
-				RenderTriangle(
-					m.vertices_out[m.indices[i]],
-					m.vertices_out[m.indices[i + 1]],
-					m.vertices_out[m.indices[i + 2]]
-				);
-			}
-			break;
+	Int2 windowSize{};
+	SDL_GetWindowSize(m_pWindow, &windowSize.x, &windowSize.y);
+
+	const bool isChanged{ m_IsDirty
+		|| m_Camera.viewMatrix != m_LastViewMatrix
+		|| m_Camera.projectionMatrix != m_LastProjectionMatrix
+		|| !std::equal(m_DrawList.begin(), m_DrawList.end(), m_LastDrawList.begin(), m_LastDrawList.end(),
+			[](const DrawCall& draw, const DrawCall& lastDraw) { return draw.pMesh == lastDraw.pMesh && draw.worldMatrix == lastDraw.worldMatrix; })
+		|| windowSize.x != m_LastWindowSize.x
+		|| windowSize.y != m_LastWindowSize.y };
+
+	//Nothing changed but the variance rates of the last frame
+	m_IsShadingRateRefresh = !isChanged && m_IsShadingRateStale;
+
+	m_IsDirty = false;
+	m_LastViewMatrix = m_Camera.viewMatrix;
+	m_LastProjectionMatrix = m_Camera.projectionMatrix;
+	m_LastDrawList = m_DrawList;
+	m_LastWindowSize = windowSize;
+
+	return isChanged || m_IsShadingRateRefresh;
+}
 
-		case PrimitiveTopology::TriangleStrip:
-			for (int i{}; i < m.indices.size() - 2; ++i)
-			{
-				if (i & 1)
-				{
-					RenderTriangle(
-						m.vertices_out[m.indices[i]],
-						m.vertices_out[m.indices[i + 2]],
-						m.vertices_out[m.indices[i + 1]]
-					);
-				}
-				else
-				{
-					RenderTriangle(
-						m.vertices_out[m.indices[i]],
-						m.vertices_out[m.indices[i + 1]],
-						m.vertices_out[m.indices[i + 2]]
-					);
-				}
-			}
-			break;
+void Renderer::UpdateResolutionScale(float frameTime)
+{
+	//Smoothed, so a single slow frame doesn't change the resolution
+	m_AverageFrameTime = m_AverageFrameTime > 0.f ? Lerpf(m_AverageFrameTime, frameTime, m_FrameTimeSmoothing) : frameTime;
+	if (++m_FramesSinceResolutionChange < m_ResolutionSettleFrames || m_AverageFrameTime <= 0.f) return;
 
-		default:
-			break;
-		}
-	}
+	//The cost of a frame mostly follows its pixel count, which goes with the square of the scale
+	//Scales are rounded to whole steps, so the resolution doesn't drift around the target by a few pixels every time
+	const float idealScale{ m_ResolutionScale * sqrtf(m_TargetFrameTime / m_AverageFrameTime) };
+	const float scale{ Clamp(roundf(idealScale / m_ResolutionScaleStep) * m_ResolutionScaleStep, m_MinResolutionScale, 1.f) };
+	if (std::abs(scale - m_ResolutionScale) < m_ResolutionScaleStep * .5f) return;
+
+	SetResolutionScale(scale);
 }
 
-bool Renderer::FrustumCulling(const Vector4& v)
+void Renderer::SetResolutionScale(float scale)
 {
-	if (v.x < -1.f || v.x > 1.f) return true;
-	if (v.y < -1.f || v.y > 1.f) return true;
-	if (v.z < 0.f || v.z > 1.f) return true;
+	m_ResolutionScale = scale;
+	m_AverageFrameTime = 0.f;
+	m_FramesSinceResolutionChange = 0;
+	m_IsDirty = true;
 
-	return false;
+	SetRenderResolution(std::max(int(m_WindowWidth * scale + .5f), 1), std::max(int(m_WindowHeight * scale + .5f), 1));
+
+	//The blocks of the rate image moved, it gets rebuilt from the first frame at the new resolution
+	std::fill_n(m_pShadingRates, m_BlockCountX * m_BlockCountY, uint8_t(1));
 }
 
-Vertex_Out Renderer::NDCToRaster(const Vertex_Out& v)
+void Renderer::SetRenderResolution(int width, int height)
 {
-	Vertex_Out temp{ v };
-	temp.position.x = ((1.f + v.position.x) / 2.f) * m_Width;
-	temp.position.y = ((1.f - v.position.y) / 2.f) * m_Height;
-	return temp;
+	m_Width = width;
+	m_Height = height;
+
+	//Only the counts change, the buffers keep their size
+	//Every pixel of the color buffer holds the clear color after a resolve, so its layout may change between frames
+	m_TileCountX = (m_Width + m_TileSize - 1) / m_TileSize;
+	m_TileCountY = (m_Height + m_TileSize - 1) / m_TileSize;
+	m_TiledPixelCount = m_TileCountX * m_TileCountY * m_TileSize * m_TileSize;
+	m_RowPitch = m_IsTiledLayout ? m_BlockSize : m_TileCountX * m_TileSize;
+	m_BlockCountX = (m_Width + m_BlockSize - 1) / m_BlockSize;
+	m_BlockCountY = (m_Height + m_BlockSize - 1) / m_BlockSize;
+	m_OcclusionTileCountX = (m_Width + m_OcclusionTileWidth - 1) / m_OcclusionTileWidth;
+	m_OcclusionTileCountY = (m_Height + m_OcclusionTileHeight - 1) / m_OcclusionTileHeight;
+
+	m_pResolvePixels = (m_Width == m_WindowWidth && m_Height == m_WindowHeight) ? m_pBackBufferPixels : m_pRenderTargetPixels;
 }
 
-bool Renderer::Remap(float& value, float min, float max)
+void Renderer::UpscaleRenderTarget()
 {
-	value = (value - min) / (max - min);
+	//Bilinear, the center of every window pixel is mapped onto the render target in 16.16 fixed point
+	//Positions before the first pixel center or after the last one clamp to the edge
+	const int stepX{ int((int64_t(m_Width) << 16) / m_WindowWidth) };
+	const int stepY{ int((int64_t(m_Height) << 16) / m_WindowHeight) };
 
-	if (value < 0.f || value > 1.f) return false;
-	return true;
+	m_pThreadPool->ParallelFor(uint32_t(m_WindowHeight), [this, stepX, stepY](uint32_t y)
+		{
+			const int sourceY{ std::max(int(y) * stepY + (stepY / 2) - (1 << 15), 0) };
+			const int y0{ std::min(sourceY >> 16, m_Height - 1) };
+			const int y1{ std::min(y0 + 1, m_Height - 1) };
+			const uint32_t weightY{ uint32_t(sourceY >> 8) & 0xFF };
+
+			const uint32_t* pRow0{ m_pRenderTargetPixels + (y0 * m_Width) };
+			const uint32_t* pRow1{ m_pRenderTargetPixels + (y1 * m_Width) };
+			uint32_t* pBack{ m_pBackBufferPixels + (y * m_WindowWidth) };
+
+			//Source columns only move to the right, their vertical blends are reused until the next column is reached
+			int column{ -1 };
+			uint32_t left{};
+			uint32_t right{ LerpColor(pRow0[0], pRow1[0], weightY) };
+
+			int sourceX{ (stepX / 2) - (1 << 15) };
+			for (int x{}; x < m_WindowWidth; ++x, sourceX += stepX)
+			{
+				const int clampedX{ std::max(sourceX, 0) };
+				const int x0{ std::min(clampedX >> 16, m_Width - 1) };
+				while (column < x0)
+				{
+					++column;
+					const int x1{ std::min(column + 1, m_Width - 1) };
+					left = right;
+					right = LerpColor(pRow0[x1], pRow1[x1], weightY);
+				}
+
+				pBack[x] = LerpColor(left, right, uint32_t(clampedX >> 8) & 0xFF);
+			}
+		});
 }
 
-void Renderer::RenderTriangle(const Vertex_Out& _v0, const Vertex_Out& _v1, const Vertex_Out& _v2)
+void Renderer::Draw(Mesh& mesh, const Matrix& worldMatrix)
 {
-	if (FrustumCulling(_v0.position) || FrustumCulling(_v1.position) || FrustumCulling(_v2.position)) return;
+	m_DrawList.push_back(DrawCall{ &mesh, worldMatrix });
+}
+
+void Renderer::RenderDrawList()
+{
+	//Reset bins, keep their memory for the next frame
+	m_Triangles.clear();
+	for (std::vector<uint32_t>& bin : m_TileBins)
+	{
+		bin.clear();
+	}
+
+	//Occluders go first, they get rendered like any other mesh but their triangles also fill the occlusion buffer
+	for (const DrawCall& draw : m_DrawList)
+	{
+		if (!draw.pMesh->isOccluder) continue;
+
+		TransformMesh(draw);
+		SubmitMesh(*draw.pMesh);
+	}
+
+	//The occlusion buffer is only worth building when there is something left to test against it
+	const bool hasOccludees{ std::any_of(m_DrawList.begin(), m_DrawList.end(), [](const DrawCall& draw) { return !draw.pMesh->isOccluder; }) };
+	if (m_IsOcclusionCulling && hasOccludees)
+	{
+		RasterizeOccluders();
+	}
 
-	Vertex_Out v0{ NDCToRaster(_v0) };
-	Vertex_Out v1{ NDCToRaster(_v1) };
-	Vertex_Out v2{ NDCToRaster(_v2) };
+	//Hidden meshes are skipped before any of their vertices get transformed
+	for (const DrawCall& draw : m_DrawList)
+	{
+		if (draw.pMesh->isOccluder) continue;
 
-	Vector2 edge0 = v2.position.GetXY() - v1.position.GetXY();
-	Vector2 edge1 = v0.position.GetXY() - v2.position.GetXY();
-	Vector2 edge2 = v1.position.GetXY() - v0.position.GetXY();
+		if (m_IsOcclusionCulling)
+		{
+			const MeshVisibility visibility{ ClassifyMesh(draw) };
+			if (visibility == MeshVisibility::Offscreen)
+			{
+				++m_Stats.offscreenMeshes;
+				continue;
+			}
+			if (visibility == MeshVisibility::Occluded)
+			{
+				++m_Stats.occludedMeshes;
+				continue;
+			}
+		}
 
-	float area{ Vector2::Cross(edge0, edge1) };
-	if (area < 0.001f) return;
+		TransformMesh(draw);
+		SubmitMesh(*draw.pMesh);
+	}
 
-	int left{ (int)std::min(v0.position.x, std::min(v1.position.x, v2.position.x)) };
-	int top{  (int)std::min(v0.position.y, std::min(v1.position.y, v2.position.y)) };
-	int right{  (int)ceilf(std::max(v0.position.x, std::max(v1.position.x, v2.position.x))) };
-	int bottom{ (int)ceilf(std::max(v0.position.y, std::max(v1.position.y, v2.position.y))) };
+	switch (m_ShadingMode)
+	{
+	case ShadingMode::Forward:
+		RasterizeTriangles(RasterPass::Forward);
+		break;
+
+	case ShadingMode::Deferred:
+		std::fill_n(m_pVisibilityBufferPixels, m_TiledPixelCount * m_SampleCount, VisibilityPixel{});
+		RasterizeTriangles(RasterPass::Visibility);
+		ShadeVisibilityBuffer();
+		break;
+
+	case ShadingMode::DepthPrepass:
+		RasterizeTriangles(RasterPass::Depth);
+		RasterizeTriangles(RasterPass::EqualDepth);
+		break;
+
+	default:
+		break;
+	}
+}
 
-	if (left < 0) left = 0;
-	if (top < 0) top = 0;
-	if (right >= m_Width) right = m_Width - 1;
-	if (bottom >= m_Height) bottom = m_Height - 1;
+void Renderer::SubmitMesh(const Mesh& m)
+{
+	//Meshlets are always triangle lists, only the ones that survived culling get submitted
+	if (!m.meshlets.empty())
+	{
+		for (uint32_t meshletIndex : m_VisibleMeshlets)
+		{
+			const Meshlet& meshlet{ m.meshlets[meshletIndex] };
+			for (uint32_t i{ meshlet.indexOffset }; i < meshlet.indexOffset + meshlet.indexCount; i += 3)
+			{
+				SubmitMeshTriangle(m, m.indices[i], m.indices[i + 1], m.indices[i + 2]);
+			}
+		}
+		return;
+	}
 
-	for (int px{ left }; px < right; ++px)
+	switch (m.primitiveTopology)
 	{
-		for (int py{ top }; py < bottom; ++py)
+	case PrimitiveTopology::TriangeList:
+		for (int i{}; i < m.indices.size() - 2; i += 3)
+		{
+			SubmitMeshTriangle(m, m.indices[i], m.indices[i + 1], m.indices[i + 2]);
+		}
+		break;
+
+	case PrimitiveTopology::TriangleStrip:
+		for (int i{}; i < m.indices.size() - 2; ++i)
 		{
-			float w0, w1, w2;
-			Vector2 pixel{ (float)px, (float)py };
+			if (i & 1)
+			{
+				SubmitMeshTriangle(m, m.indices[i], m.indices[i + 2], m.indices[i + 1]);
+			}
+			else
+			{
+				SubmitMeshTriangle(m, m.indices[i], m.indices[i + 1], m.indices[i + 2]);
+			}
+		}
+		break;
 
-			//Check if pixel is inside triangle
-			Vector2 pixelToSide = pixel - v0.position.GetXY();
-			if ((w2 = Vector2::Cross(edge2, pixelToSide) / area) < 0.f) continue;
+	default:
+		break;
+	}
+}
 
-			pixelToSide = pixel - v1.position.GetXY();
-			if ((w0 = Vector2::Cross(edge0, pixelToSide) / area) < 0.f) continue;
+void Renderer::SubmitMeshTriangle(const Mesh& m, uint32_t i0, uint32_t i1, uint32_t i2)
+{
+	if (m.vertex_streams.positionX.empty())
+	{
+		SubmitTriangle(m.vertices_out[i0], m.vertices_out[i1], m.vertices_out[i2], m.cullMode);
+		return;
+	}
 
-			pixelToSide = pixel - v2.position.GetXY();
-			if ((w1 = Vector2::Cross(edge1, pixelToSide) / area) < 0.f) continue;
+	//Only the position streams are read for the triangles that get rejected, the other attributes are gathered for the rest
+	const Vector4 p0{ GatherPosition(m, i0) };
+	const Vector4 p1{ GatherPosition(m, i1) };
+	const Vector4 p2{ GatherPosition(m, i2) };
 
-			//Calculate depth buffer
-			float depthBuffer = 1.f / (w0 / v0.position.z + w1 / v1.position.z + w2 / v2.position.z);
+	bool isFrontFace{};
+	if (IsTriangleRejected(p0, p1, p2, m.cullMode, isFrontFace)) return;
 
-			if (depthBuffer < 0 || depthBuffer > 1) continue;
+	if (isFrontFace)
+	{
+		ClipTriangle(GatherVertex(m, i0, p0), GatherVertex(m, i1, p1), GatherVertex(m, i2, p2));
+	}
+	else
+	{
+		ClipTriangle(GatherVertex(m, i0, p0), GatherVertex(m, i2, p2), GatherVertex(m, i1, p1));
+	}
+}
 
-			//Depth Test
-			if (depthBuffer < m_pDepthBufferPixels[px + (py * m_Width)])
-			{
-				//Depth Write
-				m_pDepthBufferPixels[px + (py * m_Width)] = depthBuffer;
+Vector4 Renderer::GatherPosition(const Mesh& m, uint32_t index)
+{
+	const VertexStreams& streams{ m.vertex_streams_out };
+	return { streams.positionX[index], streams.positionY[index], streams.positionZ[index], streams.positionW[index] };
+}
 
-				ColorRGB finalColor{};
-				if (m_ShowFinalColor)
-				{
-					//Depth correction
-					w0 /= v0.position.w;
-					w1 /= v1.position.w;
-					w2 /= v2.position.w;
-
-					//Calculate depth
-					float depth = 1.f / (w0 + w1 + w2);
-
-					//Update Color in Buffer
-					Vertex_Out temp{};
-					temp.position.x = (float)px;
-					temp.position.y = (float)py;
-					temp.color = (w0 * v0.color + w1 * v1.color + w2 * v2.color) * depth;
-					temp.uv = (w0 * v0.uv + w1 * v1.uv + w2 * v2.uv) * depth;
-					temp.normal = ((w0 * v0.normal + w1 * v1.normal + w2 * v2.normal) * depth).Normalized();
-					temp.tangent = ((w0 * v0.tangent + w1 * v1.tangent + w2 * v2.tangent) * depth).Normalized();
-
-					finalColor = PixelShading(temp);
-				}
-				else
-				{
-					//Remap the depthbuffer to avoid having everything in white
-					Remap(depthBuffer, 0.985f, 1.f);
+Vertex_Out Renderer::GatherVertex(const Mesh& m, uint32_t index, const Vector4& position)
+{
+	const VertexStreams& streams{ m.vertex_streams_out };
+
+	Vertex_Out v{};
+	v.position = position;
+	v.color = m.vertices[index].color;
+	v.uv = m.vertices[index].uv;
+	v.normal = { streams.normalX[index], streams.normalY[index], streams.normalZ[index] };
+	v.tangent = { streams.tangentX[index], streams.tangentY[index], streams.tangentZ[index] };
+	return v;
+}
 
-					//Clamp the depthbuffer to prevent negative values
-					depthBuffer = Clamp(depthBuffer, 0.f, 1.f);
+void Renderer::UpdateShadingRates()
+{
+	switch (m_ShadingRateMode)
+	{
+	case ShadingRateMode::Full:
+		std::fill_n(m_pShadingRates, m_BlockCountX * m_BlockCountY, uint8_t(1));
+		break;
 
-					finalColor = { depthBuffer,depthBuffer,depthBuffer };
-				}
+	case ShadingRateMode::Variance:
+		//Written while the previous frame got resolved
+		break;
 
-				//Update Color in Buffer
-				finalColor.MaxToOne();
+	case ShadingRateMode::Foveated:
+		for (int blockY{}; blockY < m_BlockCountY; ++blockY)
+		{
+			for (int blockX{}; blockX < m_BlockCountX; ++blockX)
+			{
+				const float dx{ ((blockX + .5f) * m_BlockSize - m_Width * .5f) / m_Height };
+				const float dy{ ((blockY + .5f) * m_BlockSize - m_Height * .5f) / m_Height };
+				const float distance{ sqrtf(dx * dx + dy * dy) };
 
-				m_pBackBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBackBuffer->format,
-					static_cast<uint8_t>(finalColor.r * 255),
-					static_cast<uint8_t>(finalColor.g * 255),
-					static_cast<uint8_t>(finalColor.b * 255));
+				m_pShadingRates[blockX + (blockY * m_BlockCountX)] = distance < m_FoveationRadii[0] ? 1 : (distance < m_FoveationRadii[1] ? 2 : 4);
 			}
 		}
+		break;
+
+	default:
+		break;
 	}
 }
 
-ColorRGB Renderer::PixelShading(const Vertex_Out& v)
+uint8_t Renderer::ComputeVarianceShadingRate(int blockLeft, int blockTop) const
 {
-	Vector3 lightDirection{ .577f, -.577f, .577f };
-	float lightIntensity{ 7.f };
-	float shininess{ 25.f };
-	ColorRGB finalColor{ 0.025f, 0.025f, 0.025f };
+	const int blockRight{ std::min(blockLeft + m_BlockSize, m_Width) };
+	const int blockBottom{ std::min(blockTop + m_BlockSize, m_Height) };
 
-	Vector3 normal{ v.normal };
-	Vector3 viewDirection{};
+	//Luminance of the resolved pixels, the back buffer is 32 bit RGB
+	int64_t sum{};
+	int64_t squaredSum{};
+	for (int py{ blockTop }; py < blockBottom; ++py)
+	{
+		const uint32_t* pPixel{ m_pResolvePixels + (py * m_Width) };
+		for (int px{ blockLeft }; px < blockRight; ++px)
+		{
+			const uint32_t color{ pPixel[px] };
+			const int64_t luminance{ ((((color >> 16) & 0xFF) * 77) + (((color >> 8) & 0xFF) * 150) + ((color & 0xFF) * 29)) >> 8 };
+			sum += luminance;
+			squaredSum += luminance * luminance;
+		}
+	}
 
-	const int px = (int)v.position.x;
-	const int py = (int)v.position.y;
+	//Variance times the squared pixel count, so everything stays in integers
+	const int64_t count{ (blockRight - blockLeft) * (blockBottom - blockTop) };
+	const int64_t scaledVariance{ (squaredSum * count) - (sum * sum) };
 
-	//calculate view direction
-	if (m_LightingMode == LightingMode::Specular || m_LightingMode == LightingMode::Combined)
+	if (scaledVariance < m_VarianceThresholds[0] * count * count) return 4;
+	if (scaledVariance < m_VarianceThresholds[1] * count * count) return 2;
+	return 1;
+}
+
+void Renderer::RasterizeOccluders()
+{
+	//Occlusion tiles never straddle two screen tiles, and only occluders were submitted so far, so the bins hold nothing else
+	//Every screen tile clears and fills its own occlusion tiles, in submission order like the serial path
+	if (m_pThreadPool->GetThreadCount() > 1)
 	{
-		float rx = px + 0.5f;
-		float ry = py + 0.5f;
+		m_pThreadPool->ParallelFor(uint32_t(m_TileCountX * m_TileCountY), [this](uint32_t tileIndex)
+			{
+				const Int2 clipMin{ int(tileIndex % m_TileCountX) * m_TileSize, int(tileIndex / m_TileCountX) * m_TileSize };
+				const Int2 clipMax{ std::min(clipMin.x + m_TileSize, m_Width), std::min(clipMin.y + m_TileSize, m_Height) };
 
-		float cx = (2 * (rx / float(m_Width)) - 1) * m_AspectRatio * m_Camera.fov;
-		float cy = (1 - (2 * (ry / float(m_Height)))) * m_Camera.fov;
+				const int left{ clipMin.x / m_OcclusionTileWidth };
+				const int right{ (clipMax.x + m_OcclusionTileWidth - 1) / m_OcclusionTileWidth };
+				for (int ty{ clipMin.y / m_OcclusionTileHeight }; ty < (clipMax.y + m_OcclusionTileHeight - 1) / m_OcclusionTileHeight; ++ty)
+				{
+					std::fill_n(m_OcclusionTiles.begin() + left + (ty * m_OcclusionTileCountX), right - left, OcclusionTile{ FLT_MAX });
+				}
 
-		viewDirection = (cx * m_Camera.right + cy * m_Camera.up + m_Camera.forward).Normalized();
+				for (uint32_t triangleIndex : m_TileBins[tileIndex])
+				{
+					RasterizeOccluder(m_Triangles[triangleIndex], clipMin, clipMax);
+				}
+			});
+		return;
 	}
 
-	//Normal map
-	if (m_IsNormalMap)
+	std::fill(m_OcclusionTiles.begin(), m_OcclusionTiles.end(), OcclusionTile{ FLT_MAX });
+	for (const TriangleSetup& triangle : m_Triangles)
 	{
-		Vector3 binormal = Vector3::Cross(v.normal, v.tangent);
-		Matrix tangentSpaceAxis{ v.tangent, binormal, v.normal, Vector3::Zero };
-
-		ColorRGB sampledColor = m_pTexNormal->Sample(v.uv);
-		sampledColor = (2.f * sampledColor) - ColorRGB{ 1.f, 1.f, 1.f };
+		RasterizeOccluder(triangle, { 0, 0 }, { m_Width, m_Height });
+	}
+}
 
-		normal = tangentSpaceAxis.TransformVector(sampledColor.r, sampledColor.g, sampledColor.b);
+void Renderer::RasterizeOccluder(const TriangleSetup& triangle, const Int2& clipMin, const Int2& clipMax)
+{
+	//Coverage is tracked per sample, so a pixel split between two triangles of the occluder still ends up covered
+	int64_t e0Sample[m_MaxSampleCount]{};
+	int64_t e1Sample[m_MaxSampleCount]{};
+	int64_t e2Sample[m_MaxSampleCount]{};
+	SetupSampleOffsets(triangle, e0Sample, e1Sample, e2Sample);
+
+	const int64_t sampleSpread{ GetSampleSpread() };
+	const EdgeFunction* edges[3]{ &triangle.edge0, &triangle.edge1, &triangle.edge2 };
+	int64_t sampleRange[3]{};
+	for (int i{}; i < 3; ++i)
+	{
+		sampleRange[i] = (std::abs(edges[i]->stepX) + std::abs(edges[i]->stepY)) * sampleSpread / m_SubPixelSteps;
 	}
 
-	//Observed area (lambert cosine law)
-	float dotProduct = normal * -lightDirection;
-	if (dotProduct >= 0.f)
+	//Depth is linear in screen space, so its farthest value over a tile is found in one of the corners
+	//The plane starts at the top left of the bounding box, the margin covers its rounding so the depth of a tile is never underestimated
+	const float depthMargin{ 1e-5f };
+	const float depthOrigin{ (triangle.edge0.At(triangle.left, triangle.top) * triangle.z0 + triangle.edge1.At(triangle.left, triangle.top) * triangle.z1 + triangle.edge2.At(triangle.left, triangle.top) * triangle.z2) * triangle.invArea };
+	const float depthStepX{ (triangle.edge0.stepX * triangle.z0 + triangle.edge1.stepX * triangle.z1 + triangle.edge2.stepX * triangle.z2) * triangle.invArea };
+	const float depthStepY{ (triangle.edge0.stepY * triangle.z0 + triangle.edge1.stepY * triangle.z1 + triangle.edge2.stepY * triangle.z2) * triangle.invArea };
+	const float depthTileRange{ std::max(depthStepX, 0.f) * (m_OcclusionTileWidth - 1) + std::max(depthStepY, 0.f) * (m_OcclusionTileHeight - 1) + depthMargin };
+
+	const int left{ std::max(triangle.left, clipMin.x) };
+	const int top{ std::max(triangle.top, clipMin.y) };
+	const int right{ std::min(triangle.right, clipMax.x) };
+	const int bottom{ std::min(triangle.bottom, clipMax.y) };
+
+	for (int ty{ top / m_OcclusionTileHeight }; ty <= (bottom - 1) / m_OcclusionTileHeight; ++ty)
 	{
-		switch (m_LightingMode)
+		for (int tx{ left / m_OcclusionTileWidth }; tx <= (right - 1) / m_OcclusionTileWidth; ++tx)
 		{
-		case LightingMode::ObservedArea:
-			finalColor += { dotProduct, dotProduct, dotProduct };
-			break;
+			const int tileLeft{ tx * m_OcclusionTileWidth };
+			const int tileTop{ ty * m_OcclusionTileHeight };
+			const int tileRight{ tileLeft + m_OcclusionTileWidth - 1 };
+			const int tileBottom{ tileTop + m_OcclusionTileHeight - 1 };
+
+			//Tiles completely inside the triangle skip the per pixel tests
+			bool isOutside{ false };
+			bool isInside{ true };
+			bool isSIMDRange{ m_IsSIMDEnabled };
+			for (int i{}; i < 3; ++i)
+			{
+				const int64_t edgeMax{ edges[i]->Max(tileLeft, tileTop, tileRight, tileBottom) + sampleRange[i] };
+				const int64_t edgeMin{ edges[i]->Min(tileLeft, tileTop, tileRight, tileBottom) - sampleRange[i] };
+				if (edgeMax < 0) isOutside = true;
+				if (edgeMin < 0) isInside = false;
+				if (edgeMax >= m_MaxSIMDEdgeValue || edgeMin <= -m_MaxSIMDEdgeValue) isSIMDRange = false;
+			}
+			if (isOutside) continue;
 
-		case LightingMode::Diffuse:
-			finalColor += Lambert(lightIntensity, m_pTexDiffuse->Sample(v.uv)) * dotProduct;
-			break;
+			//Without multisampling the only sample sits in the center, and its mask stands in for the unused ones
+			uint32_t coverage[m_MaxSampleCount]{ UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX };
+			if (!isInside)
+			{
+				uint32_t anyCoverage{};
+				for (int sample{}; sample < m_MaxSampleCount; ++sample)
+				{
+					if (sample >= m_SampleCount)
+					{
+						coverage[sample] = coverage[0];
+						continue;
+					}
+
+					coverage[sample] = isSIMDRange ?
+						ComputeOccluderCoverageAVX2(triangle, tileLeft, tileTop, e0Sample[sample], e1Sample[sample], e2Sample[sample]) :
+						ComputeOccluderCoverage(triangle, tileLeft, tileTop, e0Sample[sample], e1Sample[sample], e2Sample[sample]);
+					anyCoverage |= coverage[sample];
+				}
 
-		case LightingMode::Specular:
-			finalColor += Phong(m_pTexSpecular->Sample(v.uv), shininess * m_pTexGloss->Sample(v.uv).r, -lightDirection, viewDirection, normal) * dotProduct;
-			break;
+				if (anyCoverage == 0) continue;
+			}
 
-		case LightingMode::Combined:
-			finalColor += Lambert(lightIntensity, m_pTexDiffuse->Sample(v.uv)) * dotProduct;
-			finalColor += Phong(m_pTexSpecular->Sample(v.uv), shininess * m_pTexGloss->Sample(v.uv).r, -lightDirection, viewDirection, normal) * dotProduct;
-			break;
+			const float depth{ std::min(triangle.maxDepth, depthOrigin + (tileLeft - triangle.left) * depthStepX + (tileTop - triangle.top) * depthStepY + depthTileRange) };
+
+			OcclusionTile& tile{ m_OcclusionTiles[tx + (ty * m_OcclusionTileCountX)] };
+
+			//Behind the reference layer, the triangle can't hide anything that isn't hidden already
+			if (depth >= tile.layerDepth) continue;
+
+			for (int sample{}; sample < m_MaxSampleCount; ++sample)
+			{
+				tile.coverage[sample] |= coverage[sample];
+			}
+			tile.workingDepth = std::max(tile.workingDepth, depth);
+
+			//Once the working layer covers the whole tile it becomes the new reference layer
+			if (tile.GetCoverage() == UINT32_MAX)
+			{
+				tile.layerDepth = tile.workingDepth;
+				tile.workingDepth = 0.f;
+				std::fill_n(tile.coverage, m_MaxSampleCount, 0);
+			}
 		}
 	}
-
-	return finalColor;
 }
 
-void Renderer::VertexTransformationFunction(Mesh& mesh) const
+uint32_t Renderer::ComputeOccluderCoverage(const TriangleSetup& triangle, int tileLeft, int tileTop, int64_t e0Sample, int64_t e1Sample, int64_t e2Sample) const
 {
-	VertexTransformationFunction(mesh.vertices, mesh.vertices_out, mesh.worldMatrix);
+	uint32_t coverage{};
+	for (int row{}; row < m_OcclusionTileHeight; ++row)
+	{
+		int64_t e0{ triangle.edge0.At(tileLeft, tileTop + row) + e0Sample };
+		int64_t e1{ triangle.edge1.At(tileLeft, tileTop + row) + e1Sample };
+		int64_t e2{ triangle.edge2.At(tileLeft, tileTop + row) + e2Sample };
+
+		for (int column{}; column < m_OcclusionTileWidth; ++column, e0 += triangle.edge0.stepX, e1 += triangle.edge1.stepX, e2 += triangle.edge2.stepX)
+		{
+			if ((e0 | e1 | e2) >= 0) coverage |= 1u << (column + (row * m_OcclusionTileWidth));
+		}
+	}
+	return coverage;
 }
 
-void Renderer::VertexTransformationFunction(std::vector<Mesh>& meshes) const
+AVX2_FUNCTION uint32_t Renderer::ComputeOccluderCoverageAVX2(const TriangleSetup& triangle, int tileLeft, int tileTop, int64_t e0Sample, int64_t e1Sample, int64_t e2Sample) const
 {
-	for (int i{}; i < meshes.size(); ++i)
+	//A row of a tile is 8 pixels wide, just like a SIMD group
+	const __m256i laneIndex{ _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7) };
+	const __m256i e0LaneStep{ _mm256_mullo_epi32(laneIndex, _mm256_set1_epi32(int32_t(triangle.edge0.stepX))) };
+	const __m256i e1LaneStep{ _mm256_mullo_epi32(laneIndex, _mm256_set1_epi32(int32_t(triangle.edge1.stepX))) };
+	const __m256i e2LaneStep{ _mm256_mullo_epi32(laneIndex, _mm256_set1_epi32(int32_t(triangle.edge2.stepX))) };
+
+	uint32_t coverage{};
+	for (int row{}; row < m_OcclusionTileHeight; ++row)
 	{
-		VertexTransformationFunction(meshes[i].vertices, meshes[i].vertices_out, meshes[i].worldMatrix);
+		const __m256i edge0{ _mm256_add_epi32(_mm256_set1_epi32(int32_t(triangle.edge0.At(tileLeft, tileTop + row) + e0Sample)), e0LaneStep) };
+		const __m256i edge1{ _mm256_add_epi32(_mm256_set1_epi32(int32_t(triangle.edge1.At(tileLeft, tileTop + row) + e1Sample)), e1LaneStep) };
+		const __m256i edge2{ _mm256_add_epi32(_mm256_set1_epi32(int32_t(triangle.edge2.At(tileLeft, tileTop + row) + e2Sample)), e2LaneStep) };
+
+		//The sign bits of the lanes are set for pixels outside of any edge
+		const uint32_t outside{ uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(_mm256_or_si256(edge0, edge1), edge2)))) };
+		coverage |= (~outside & 0xFF) << (row * m_OcclusionTileWidth);
 	}
+	return coverage;
 }
 
-void Renderer::VertexTransformationFunction(const std::vector<Vertex>& vertices_in, std::vector<Vertex_Out>& vertices_out, const Matrix& worldMatrix) const
+Renderer::MeshVisibility Renderer::ClassifyMesh(const DrawCall& draw) const
 {
-	Matrix worldViewProjectionMatrix{ worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix };
-	vertices_out.clear();
-	vertices_out.reserve(vertices_in.size());
+	const Mesh& mesh{ *draw.pMesh };
+	const Matrix worldViewProjectionMatrix{ draw.worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix };
+
+	//Project the corners of the bounding box, the box's screen rect and nearest depth bound the depth of every pixel of the mesh
+	float left{ FLT_MAX };
+	float top{ FLT_MAX };
+	float right{ -FLT_MAX };
+	float bottom{ -FLT_MAX };
+	float nearestDepth{ FLT_MAX };
 
-	for (int i{}; i < vertices_in.size(); ++i)
+	for (int corner{}; corner < 8; ++corner)
 	{
-		//Create temporary variable
+		const Vector3 position{
+			(corner & 1) ? mesh.boundsMax.x : mesh.boundsMin.x,
+			(corner & 2) ? mesh.boundsMax.y : mesh.boundsMin.y,
+			(corner & 4) ? mesh.boundsMax.z : mesh.boundsMin.z
+		};
+
 		Vertex_Out v{};
+		v.position = worldViewProjectionMatrix.TransformPoint({ position, 1.f });
 
-		//Position calculations
-		v.position = worldViewProjectionMatrix.TransformPoint({ vertices_in[i].position, 1.f });
+		//Part of the box is in front of the near plane, its projection can't be trusted
+		if (v.position.z < 0.f || v.position.w <= 0.f) return MeshVisibility::Visible;
 
-		v.position.x /= v.position.w;
-		v.position.y /= v.position.w;
-		v.position.z /= v.position.w;
+		v = NDCToRaster(PerspectiveDivide(v));
+		left = std::min(left, v.position.x);
+		top = std::min(top, v.position.y);
+		right = std::max(right, v.position.x);
+		bottom = std::max(bottom, v.position.y);
+		nearestDepth = std::min(nearestDepth, v.position.z);
+	}
 
-		//Set other variables
-		v.color = vertices_in[i].color;
-		v.uv = vertices_in[i].uv;
-		v.normal = worldMatrix.TransformVector(vertices_in[i].normal);
-		v.tangent = worldMatrix.TransformVector(vertices_in[i].tangent);
+	//Pixels the rect touches, clamped to the screen
+	const int pixelLeft{ std::max(int(std::floor(left)), 0) };
+	const int pixelTop{ std::max(int(std::floor(top)), 0) };
+	const int pixelRight{ std::min(int(std::ceil(right)), m_Width) };
+	const int pixelBottom{ std::min(int(std::ceil(bottom)), m_Height) };
+
+	//Nothing of the mesh ends up on the screen
+	if (pixelLeft >= pixelRight || pixelTop >= pixelBottom) return MeshVisibility::Offscreen;
+
+	for (int ty{ pixelTop / m_OcclusionTileHeight }; ty <= (pixelBottom - 1) / m_OcclusionTileHeight; ++ty)
+	{
+		for (int tx{ pixelLeft / m_OcclusionTileWidth }; tx <= (pixelRight - 1) / m_OcclusionTileWidth; ++tx)
+		{
+			const OcclusionTile& tile{ m_OcclusionTiles[tx + (ty * m_OcclusionTileCountX)] };
 
-		//Add the new temporary variable to the list
-		vertices_out.emplace_back(v);
+			//Behind the reference layer, hidden in this whole tile
+			if (nearestDepth > tile.layerDepth) continue;
+
+			//Pixels of the tile that the rect touches
+			const int columnMin{ std::max(pixelLeft - (tx * m_OcclusionTileWidth), 0) };
+			const int columnMax{ std::min(pixelRight - 1 - (tx * m_OcclusionTileWidth), m_OcclusionTileWidth - 1) };
+			const int rowMin{ std::max(pixelTop - (ty * m_OcclusionTileHeight), 0) };
+			const int rowMax{ std::min(pixelBottom - 1 - (ty * m_OcclusionTileHeight), m_OcclusionTileHeight - 1) };
+
+			const uint32_t rowMask{ ((2u << columnMax) - 1) & ~((1u << columnMin) - 1) };
+			uint32_t mask{};
+			for (int row{ rowMin }; row <= rowMax; ++row)
+			{
+				mask |= rowMask << (row * m_OcclusionTileWidth);
+			}
+
+			//Otherwise only hidden when the working layer covers all of those pixels and lies in front
+			if ((mask & ~tile.GetCoverage()) != 0 || nearestDepth <= tile.workingDepth) return MeshVisibility::Visible;
+		}
 	}
-}
 
-void Renderer::ToggleFinalColor()
-{
-	m_ShowFinalColor = !m_ShowFinalColor;
+	return MeshVisibility::Occluded;
 }
 
-void Renderer::ToggleRotation()
+void Renderer::RasterizeTriangles(RasterPass pass)
 {
-	m_IsRotating = !m_IsRotating;
-}
+	if (m_pThreadPool->GetThreadCount() > 1)
+	{
+		std::fill(m_TileStats.begin(), m_TileStats.end(), RenderStats{});
 
-void Renderer::ToggleNormalMap()
-{
+		m_pThreadPool->ParallelFor(uint32_t(m_TileCountX * m_TileCountY), [this, pass](uint32_t tileIndex)
+			{
+				const Int2 clipMin{ int(tileIndex % m_TileCountX) * m_TileSize, int(tileIndex / m_TileCountX) * m_TileSize };
+				const Int2 clipMax{ std::min(clipMin.x + m_TileSize, m_Width), std::min(clipMin.y + m_TileSize, m_Height) };
+
+				//Triangles were binned in submission order, so every pixel sees the same depth tests as the serial path
+				for (uint32_t triangleIndex : m_TileBins[tileIndex])
+				{
+					RasterizeTriangle(pass, triangleIndex, clipMin, clipMax, m_TileStats[tileIndex]);
+				}
+
+				if (pass != RasterPass::EqualDepth)
+				{
+					UpdateTileDepth(int(tileIndex % m_TileCountX), int(tileIndex / m_TileCountX));
+				}
+			});
+
+		for (const RenderStats& stats : m_TileStats)
+		{
+			m_Stats += stats;
+		}
+		return;
+	}
+
+	for (uint32_t triangleIndex{}; triangleIndex < uint32_t(m_Triangles.size()); ++triangleIndex)
+	{
+		RasterizeTriangle(pass, triangleIndex, { 0, 0 }, { m_Width, m_Height }, m_Stats);
+	}
+
+	if (pass != RasterPass::EqualDepth)
+	{
+		for (int tileY{}; tileY < m_TileCountY; ++tileY)
+		{
+			for (int tileX{}; tileX < m_TileCountX; ++tileX)
+			{
+				UpdateTileDepth(tileX, tileY);
+			}
+		}
+	}
+}
+
+void Renderer::RasterizeTriangle(RasterPass pass, uint32_t triangleIndex, const Int2& clipMin, const Int2& clipMax, RenderStats& stats) const
+{
+	switch (pass)
+	{
+	case RasterPass::Forward:
+		RasterizeTriangle<RasterPass::Forward>(triangleIndex, clipMin, clipMax, stats);
+		break;
+
+	case RasterPass::Visibility:
+		RasterizeTriangle<RasterPass::Visibility>(triangleIndex, clipMin, clipMax, stats);
+		break;
+
+	case RasterPass::Depth:
+		RasterizeTriangle<RasterPass::Depth>(triangleIndex, clipMin, clipMax, stats);
+		break;
+
+	case RasterPass::EqualDepth:
+		RasterizeTriangle<RasterPass::EqualDepth>(triangleIndex, clipMin, clipMax, stats);
+		break;
+	}
+}
+
+void Renderer::ShadeVisibilityBuffer()
+{
+	//Every visible pixel gets shaded exactly once, tiles don't depend on each other so they are shaded in parallel
+	m_pThreadPool->ParallelFor(uint32_t(m_TileCountX * m_TileCountY), [this](uint32_t tileIndex)
+		{
+			const int tileLeft{ int(tileIndex % m_TileCountX) * m_TileSize };
+			const int tileTop{ int(tileIndex / m_TileCountX) * m_TileSize };
+			const int tileRight{ std::min(tileLeft + m_TileSize, m_Width) };
+			const int tileBottom{ std::min(tileTop + m_TileSize, m_Height) };
+
+			for (int blockTop{ tileTop }; blockTop < tileBottom; blockTop += m_BlockSize)
+			{
+				for (int blockLeft{ tileLeft }; blockLeft < tileRight; blockLeft += m_BlockSize)
+				{
+					CoarseShading cells{};
+					int rowIndex{ PixelIndex(blockLeft, blockTop) };
+					for (int py{ blockTop }; py < std::min(blockTop + m_BlockSize, tileBottom); ++py, rowIndex += m_RowPitch)
+					{
+						for (int px{ blockLeft }; px < std::min(blockLeft + m_BlockSize, tileRight); ++px)
+						{
+							const int pixelIndex{ rowIndex + (px - blockLeft) };
+
+							for (int sample{}; sample < m_SampleCount; ++sample)
+							{
+								const int sampleIndex{ pixelIndex + (sample * m_TiledPixelCount) };
+								const VisibilityPixel& pixel{ m_pVisibilityBufferPixels[sampleIndex] };
+								if (pixel.triangleIndex == VisibilityPixel::NoTriangle) continue;
+
+								//Samples covered by the same triangle share its color, every triangle is shaded once per pixel
+								int shadedSample{};
+								while (m_pVisibilityBufferPixels[pixelIndex + (shadedSample * m_TiledPixelCount)].triangleIndex != pixel.triangleIndex) ++shadedSample;
+
+								m_pColorBufferPixels[sampleIndex] = shadedSample < sample ?
+									m_pColorBufferPixels[pixelIndex + (shadedSample * m_TiledPixelCount)] :
+									ShadeCoarsePixel(pixel.triangleIndex, px, py, m_pDepthBufferPixels[sampleIndex], cells);
+							}
+						}
+					}
+				}
+			}
+		});
+}
+
+void Renderer::ResolveColorBuffer()
+{
+	//Copies the tiled color buffer into the linear back buffer, a whole row of blocks at a time so the back buffer is written in long runs
+	//With multisampling the samples of every pixel are averaged on the way
+	//Every block gets cleared for the next frame while it is still in the cache
+	//Blocks without a single written sample still hold the clear color, they are neither read nor cleared
+	std::atomic<bool> isShadingRateChanged{ false };
+	m_pThreadPool->ParallelFor(uint32_t(m_BlockCountY), [this, &isShadingRateChanged](uint32_t blockY)
+		{
+			const int blockTop{ int(blockY) * m_BlockSize };
+			const int blockBottom{ std::min(blockTop + m_BlockSize, m_Height) };
+			alignas(16) uint32_t resolvedRow[8];
+
+			for (int blockLeft{}; blockLeft < m_Width; blockLeft += m_BlockSize)
+			{
+				const int width{ std::min(m_BlockSize, m_Width - blockLeft) };
+
+				//The rate image of the next frame follows the contrast of this one
+				const auto updateShadingRate = [&]()
+					{
+						if (m_ShadingRateMode == ShadingRateMode::Variance)
+						{
+							uint8_t& shadingRate{ m_pShadingRates[(blockLeft / m_BlockSize) + (blockY * m_BlockCountX)] };
+							const uint8_t newShadingRate{ ComputeVarianceShadingRate(blockLeft, blockTop) };
+							if (newShadingRate != shadingRate)
+							{
+								shadingRate = newShadingRate;
+								isShadingRateChanged.store(true, std::memory_order_relaxed);
+							}
+						}
+					};
+
+				//The hierarchical depth buffer tells which blocks got drawn into
+				if (m_pBlockMinDepth[(blockLeft / m_BlockSize) + (blockY * m_BlockCountX)] == FLT_MAX)
+				{
+					for (int py{ blockTop }; py < blockBottom; ++py)
+					{
+						std::fill_n(m_pResolvePixels + blockLeft + (py * m_Width), width, m_ClearColor);
+					}
+					updateShadingRate();
+					continue;
+				}
+
+				uint32_t* pBlock{ m_pColorBufferPixels + PixelIndex(blockLeft, blockTop) };
+
+				const uint32_t* pColor{ pBlock };
+				for (int py{ blockTop }; py < blockBottom; ++py, pColor += m_RowPitch)
+				{
+					//SSE2 is always available on x64, no need to check for it
+					__m128i left{ _mm_load_si128((const __m128i*)pColor) };
+					__m128i right{ _mm_load_si128((const __m128i*)pColor + 1) };
+					if (m_SampleCount > 1)
+					{
+						left = ResolveSamples(pColor, m_SampleCount, m_TiledPixelCount);
+						right = ResolveSamples(pColor + 4, m_SampleCount, m_TiledPixelCount);
+					}
+
+					uint32_t* pBack{ m_pResolvePixels + blockLeft + (py * m_Width) };
+					if (width == m_BlockSize)
+					{
+						_mm_storeu_si128((__m128i*)pBack, left);
+						_mm_storeu_si128((__m128i*)pBack + 1, right);
+					}
+					else
+					{
+						_mm_store_si128((__m128i*)resolvedRow, left);
+						_mm_store_si128((__m128i*)resolvedRow + 1, right);
+						std::copy_n(resolvedRow, width, pBack);
+					}
+				}
+
+				for (int sample{}; sample < m_SampleCount; ++sample)
+				{
+					for (int row{}; row < m_BlockSize; ++row)
+					{
+						std::fill_n(pBlock + (sample * m_TiledPixelCount) + (row * m_RowPitch), m_BlockSize, m_ClearColor);
+					}
+				}
+				updateShadingRate();
+			}
+		});
+
+	m_IsShadingRateStale = isShadingRateChanged && !m_IsShadingRateRefresh;
+}
+
+int Renderer::PixelIndex(int px, int py) const
+{
+	if (!m_IsTiledLayout) return px + (py * m_RowPitch);
+
+	//Morton order of the 8x8 blocks inside a tile, for 3 bits of x and y
+	static constexpr int spreadBits[8]{ 0, 1, 4, 5, 16, 17, 20, 21 };
+
+	const int tileIndex{ (px / m_TileSize) + ((py / m_TileSize) * m_TileCountX) };
+	const int blockX{ (px % m_TileSize) / m_BlockSize };
+	const int blockY{ (py % m_TileSize) / m_BlockSize };
+	const int blockIndex{ spreadBits[blockX] | (spreadBits[blockY] << 1) };
+
+	return (tileIndex * m_TileSize * m_TileSize) + (blockIndex * m_BlockSize * m_BlockSize) + ((py % m_BlockSize) * m_BlockSize) + (px % m_BlockSize);
+}
+
+float Renderer::ComputeWinding(const Vector4& p0, const Vector4& p1, const Vector4& p2)
+{
+	//Determinant of the (x, y, w) clip space positions, its sign is the facing of the triangle as seen from the camera
+	//Unlike the screen space area this doesn't need the perspective divide, so it also works for vertices behind the camera
+	return p0.x * (p1.y * p2.w - p2.y * p1.w)
+		- p1.x * (p0.y * p2.w - p2.y * p0.w)
+		+ p2.x * (p0.y * p1.w - p1.y * p0.w);
+}
+
+uint8_t Renderer::ComputeOutcode(const Vector4& position, float guardBand)
+{
+	uint8_t outcode{};
+	if (position.x < -guardBand * position.w) outcode |= ClipPlane::Left;
+	if (position.x > guardBand * position.w) outcode |= ClipPlane::Right;
+	if (position.y < -guardBand * position.w) outcode |= ClipPlane::Bottom;
+	if (position.y > guardBand * position.w) outcode |= ClipPlane::Top;
+	if (position.z < 0.f) outcode |= ClipPlane::Near;
+	if (position.z > position.w) outcode |= ClipPlane::Far;
+
+	return outcode;
+}
+
+float Renderer::ClipDistance(const Vector4& position, uint8_t plane, float guardBand)
+{
+	//Positive inside the plane, negative outside
+	switch (plane)
+	{
+	case ClipPlane::Left: return position.x + guardBand * position.w;
+	case ClipPlane::Right: return guardBand * position.w - position.x;
+	case ClipPlane::Bottom: return position.y + guardBand * position.w;
+	case ClipPlane::Top: return guardBand * position.w - position.y;
+	case ClipPlane::Near: return position.z;
+	default: return position.w - position.z;
+	}
+}
+
+Vertex_Out Renderer::LerpVertex(const Vertex_Out& v0, const Vertex_Out& v1, float t)
+{
+	//Every attribute is linear in clip space, so the new vertex is a plain interpolation
+	Vertex_Out v{};
+	v.position = v0.position + (v1.position - v0.position) * t;
+	v.color = v0.color + (v1.color - v0.color) * t;
+	v.uv = v0.uv + (v1.uv - v0.uv) * t;
+	v.normal = v0.normal + (v1.normal - v0.normal) * t;
+	v.tangent = v0.tangent + (v1.tangent - v0.tangent) * t;
+	return v;
+}
+
+Vertex_Out Renderer::PerspectiveDivide(const Vertex_Out& v) const
+{
+	//w is kept for perspective correct interpolation
+	Vertex_Out temp{ v };
+	temp.position.x /= v.position.w;
+	temp.position.y /= v.position.w;
+	temp.position.z /= v.position.w;
+	return temp;
+}
+
+Vertex_Out Renderer::NDCToRaster(const Vertex_Out& v) const
+{
+	Vertex_Out temp{ v };
+	temp.position.x = ((1.f + v.position.x) / 2.f) * m_Width;
+	temp.position.y = ((1.f - v.position.y) / 2.f) * m_Height;
+	return temp;
+}
+
+bool Renderer::Remap(float& value, float min, float max) const
+{
+	value = (value - min) / (max - min);
+
+	if (value < 0.f || value > 1.f) return false;
+	return true;
+}
+
+void Renderer::SubmitTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2, CullMode cullMode)
+{
+	bool isFrontFace{};
+	if (IsTriangleRejected(v0.position, v1.position, v2.position, cullMode, isFrontFace)) return;
+
+	//The rasterizer only accepts front faces, so back faces that are drawn get their winding flipped
+	if (isFrontFace)
+	{
+		ClipTriangle(v0, v1, v2);
+	}
+	else
+	{
+		ClipTriangle(v0, v2, v1);
+	}
+}
+
+bool Renderer::IsTriangleRejected(const Vector4& p0, const Vector4& p1, const Vector4& p2, CullMode cullMode, bool& isFrontFace)
+{
+	//Face culling, before anything gets copied
+	const float winding{ ComputeWinding(p0, p1, p2) };
+	if (winding == 0.f) return true;
+
+	isFrontFace = winding < 0.f;
+	if ((cullMode == CullMode::Back && !isFrontFace) || (cullMode == CullMode::Front && isFrontFace))
+	{
+		++m_Stats.culledTriangles;
+		return true;
+	}
+
+	//Trivial reject, all vertices are outside of the same frustum plane
+	return (ComputeOutcode(p0, 1.f) & ComputeOutcode(p1, 1.f) & ComputeOutcode(p2, 1.f)) != 0;
+}
+
+void Renderer::ClipTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2)
+{
+	//Triangles that stay inside of the guard band are only scissored by the rasterizer
+	//The far plane is never clipped, pixels behind it fail the depth range test
+	const uint8_t guardBandMask{ ClipPlane::Left | ClipPlane::Right | ClipPlane::Bottom | ClipPlane::Top | ClipPlane::Near };
+	const uint8_t clipPlanes{ uint8_t((ComputeOutcode(v0.position, m_GuardBand) | ComputeOutcode(v1.position, m_GuardBand) | ComputeOutcode(v2.position, m_GuardBand)) & guardBandMask) };
+	if (clipPlanes == 0)
+	{
+		AddTriangle(v0, v1, v2);
+		return;
+	}
+
+	++m_Stats.clippedTriangles;
+
+	//Sutherland-Hodgman, every plane adds at most one vertex to the polygon
+	Vertex_Out polygon[2][8]{};
+	int count{ 3 };
+	polygon[0][0] = v0;
+	polygon[0][1] = v1;
+	polygon[0][2] = v2;
+
+	int current{};
+	for (uint8_t plane : { ClipPlane::Near, ClipPlane::Left, ClipPlane::Right, ClipPlane::Bottom, ClipPlane::Top })
+	{
+		if ((clipPlanes & plane) == 0) continue;
+
+		const Vertex_Out* pIn{ polygon[current] };
+		Vertex_Out* pOut{ polygon[1 - current] };
+		int outCount{};
+
+		for (int i{}; i < count; ++i)
+		{
+			const Vertex_Out& start{ pIn[i] };
+			const Vertex_Out& end{ pIn[(i + 1) % count] };
+			const float startDistance{ ClipDistance(start.position, plane, m_GuardBand) };
+			const float endDistance{ ClipDistance(end.position, plane, m_GuardBand) };
+
+			if (startDistance >= 0.f)
+			{
+				pOut[outCount++] = start;
+			}
+			if ((startDistance >= 0.f) != (endDistance >= 0.f))
+			{
+				pOut[outCount++] = LerpVertex(start, end, startDistance / (startDistance - endDistance));
+			}
+		}
+
+		current = 1 - current;
+		count = outCount;
+		if (count < 3) return;
+	}
+
+	//The clipped polygon is convex, so a fan keeps the winding of the original triangle
+	for (int i{ 1 }; i < count - 1; ++i)
+	{
+		AddTriangle(polygon[current][0], polygon[current][i], polygon[current][i + 1]);
+	}
+}
+
+void Renderer::AddTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2)
+{
+	TriangleSetup triangle{};
+	if (!SetupTriangle(v0, v1, v2, triangle)) return;
+
+	if (triangle.isSmall)
+	{
+		++m_Stats.smallTriangles;
+
+		//Small triangles often fall between the pixel centers, those are dropped before they get binned
+		if (!IsCoveringPixel(triangle))
+		{
+			++m_Stats.smallTrianglesCulled;
+			return;
+		}
+	}
+
+	const uint32_t triangleIndex{ uint32_t(m_Triangles.size()) };
+	m_Triangles.emplace_back(triangle);
+
+	if (m_pThreadPool->GetThreadCount() > 1)
+	{
+		//Bin the triangle into every tile its bounding box touches
+		for (int ty{ triangle.top / m_TileSize }; ty <= (triangle.bottom - 1) / m_TileSize; ++ty)
+		{
+			for (int tx{ triangle.left / m_TileSize }; tx <= (triangle.right - 1) / m_TileSize; ++tx)
+			{
+				m_TileBins[tx + (ty * m_TileCountX)].emplace_back(triangleIndex);
+			}
+		}
+	}
+}
+
+bool Renderer::SetupTriangle(const Vertex_Out& _v0, const Vertex_Out& _v1, const Vertex_Out& _v2, TriangleSetup& triangle) const
+{
+	const Vertex_Out v0{ NDCToRaster(PerspectiveDivide(_v0)) };
+	const Vertex_Out v1{ NDCToRaster(PerspectiveDivide(_v1)) };
+	const Vertex_Out v2{ NDCToRaster(PerspectiveDivide(_v2)) };
+
+	//Snap to 28.4 fixed point so shared edges produce the exact same edge values in both triangles
+	const int64_t x0{ lroundf(v0.position.x * m_SubPixelSteps) };
+	const int64_t y0{ lroundf(v0.position.y * m_SubPixelSteps) };
+	const int64_t x1{ lroundf(v1.position.x * m_SubPixelSteps) };
+	const int64_t y1{ lroundf(v1.position.y * m_SubPixelSteps) };
+	const int64_t x2{ lroundf(v2.position.x * m_SubPixelSteps) };
+	const int64_t y2{ lroundf(v2.position.y * m_SubPixelSteps) };
+
+	//Doubled area, also rejects back faces and degenerate triangles
+	const int64_t area{ (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0) };
+	if (area <= 0) return false;
+
+	triangle.edge0 = SetupEdge(x1, y1, x2, y2);
+	triangle.edge1 = SetupEdge(x2, y2, x0, y0);
+	triangle.edge2 = SetupEdge(x0, y0, x1, y1);
+	triangle.area = area;
+	triangle.invArea = 1.f / area;
+
+	//The edge values add up to the area minus the fill rule bias in every pixel
+	//Tiny triangles can lose all of it, their pixels would end up without any weight
+	const int64_t edgeSum{ triangle.edge0.origin + triangle.edge1.origin + triangle.edge2.origin };
+	if (edgeSum <= 0) return false;
+
+	//The depth is a weighted mean of the vertex depths, but the fill rule bias makes the weights sum up to slightly less than 1
+	//Margins cover that and the rounding of the interpolation, so hierarchical depth tests never disagree with the per pixel ones
+	const float depthMargin{ 1e-5f };
+	const float weightSum{ float(edgeSum) / area };
+	triangle.z0 = v0.position.z;
+	triangle.z1 = v1.position.z;
+	triangle.z2 = v2.position.z;
+	const float minZ{ std::min(triangle.z0, std::min(triangle.z1, triangle.z2)) };
+	const float maxZ{ std::max(triangle.z0, std::max(triangle.z1, triangle.z2)) };
+	triangle.minDepth = std::min(minZ, minZ * weightSum) - depthMargin;
+	triangle.maxDepth = std::max(maxZ, maxZ * weightSum) + depthMargin;
+
+	//Bounding box of the pixels with a sample inside the triangle
+	const int64_t halfPixel{ m_SubPixelSteps / 2 };
+	const int64_t sampleSpread{ GetSampleSpread() };
+	triangle.left = int((std::min(x0, std::min(x1, x2)) - halfPixel - sampleSpread + m_SubPixelSteps - 1) >> m_SubPixelBits);
+	triangle.top = int((std::min(y0, std::min(y1, y2)) - halfPixel - sampleSpread + m_SubPixelSteps - 1) >> m_SubPixelBits);
+	triangle.right = int((std::max(x0, std::max(x1, x2)) - halfPixel + sampleSpread) >> m_SubPixelBits) + 1;
+	triangle.bottom = int((std::max(y0, std::max(y1, y2)) - halfPixel + sampleSpread) >> m_SubPixelBits) + 1;
+
+	if (triangle.left < 0) triangle.left = 0;
+	if (triangle.top < 0) triangle.top = 0;
+	if (triangle.right > m_Width) triangle.right = m_Width;
+	if (triangle.bottom > m_Height) triangle.bottom = m_Height;
+
+	//Nothing to rasterize
+	if (triangle.left >= triangle.right || triangle.top >= triangle.bottom) return false;
+
+	triangle.isSmall = triangle.right - triangle.left <= m_SmallTriangleSize && triangle.bottom - triangle.top <= m_SmallTriangleSize;
+
+	//Attributes divided by w are linear in screen space, their planes are built from the barycentric weights
+	//The weights are taken at the top left of the bounding box, so the planes are never evaluated far from their origin
+	const float weight0{ triangle.edge0.At(triangle.left, triangle.top) * triangle.invArea };
+	const float weight1{ triangle.edge1.At(triangle.left, triangle.top) * triangle.invArea };
+	const float weight2{ triangle.edge2.At(triangle.left, triangle.top) * triangle.invArea };
+
+	const auto setupPlane = [&](float value0, float value1, float value2)
+		{
+			AttributePlane plane{};
+			plane.origin = weight0 * value0 + weight1 * value1 + weight2 * value2;
+			plane.stepX = (triangle.edge0.stepX * value0 + triangle.edge1.stepX * value1 + triangle.edge2.stepX * value2) * triangle.invArea;
+			plane.stepY = (triangle.edge0.stepY * value0 + triangle.edge1.stepY * value1 + triangle.edge2.stepY * value2) * triangle.invArea;
+			return plane;
+		};
+
+	const float invW0{ 1.f / v0.position.w };
+	const float invW1{ 1.f / v1.position.w };
+	const float invW2{ 1.f / v2.position.w };
+
+	triangle.invW = setupPlane(invW0, invW1, invW2);
+	triangle.u = setupPlane(v0.uv.x * invW0, v1.uv.x * invW1, v2.uv.x * invW2);
+	triangle.v = setupPlane(v0.uv.y * invW0, v1.uv.y * invW1, v2.uv.y * invW2);
+	for (int i{}; i < 3; ++i)
+	{
+		triangle.normal[i] = setupPlane(v0.normal[i] * invW0, v1.normal[i] * invW1, v2.normal[i] * invW2);
+		triangle.tangent[i] = setupPlane(v0.tangent[i] * invW0, v1.tangent[i] * invW1, v2.tangent[i] * invW2);
+	}
+
+	return true;
+}
+
+bool Renderer::IsCoveringPixel(const TriangleSetup& triangle) const
+{
+	int64_t e0Sample[m_MaxSampleCount]{};
+	int64_t e1Sample[m_MaxSampleCount]{};
+	int64_t e2Sample[m_MaxSampleCount]{};
+	SetupSampleOffsets(triangle, e0Sample, e1Sample, e2Sample);
+
+	for (int py{ triangle.top }; py < triangle.bottom; ++py)
+	{
+		for (int px{ triangle.left }; px < triangle.right; ++px)
+		{
+			for (int sample{}; sample < m_SampleCount; ++sample)
+			{
+				const int64_t e0{ triangle.edge0.At(px, py) + e0Sample[sample] };
+				const int64_t e1{ triangle.edge1.At(px, py) + e1Sample[sample] };
+				const int64_t e2{ triangle.edge2.At(px, py) + e2Sample[sample] };
+				if ((e0 | e1 | e2) >= 0) return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+EdgeFunction Renderer::SetupEdge(int64_t x0, int64_t y0, int64_t x1, int64_t y1) const
+{
+	const int64_t a{ y0 - y1 };
+	const int64_t b{ x1 - x0 };
+
+	//Top-left fill rule: pixels exactly on an edge only belong to the triangle if it is a top or left edge
+	const bool isTopLeft{ a > 0 || (a == 0 && b > 0) };
+
+	const int64_t halfPixel{ m_SubPixelSteps / 2 };
+
+	EdgeFunction edge{};
+	edge.origin = a * (halfPixel - x0) + b * (halfPixel - y0) - (isTopLeft ? 0 : 1);
+	edge.stepX = a * m_SubPixelSteps;
+	edge.stepY = b * m_SubPixelSteps;
+	return edge;
+}
+
+template<Renderer::RasterPass pass>
+void Renderer::RasterizeTriangle(uint32_t triangleIndex, const Int2& clipMin, const Int2& clipMax, RenderStats& stats) const
+{
+	const TriangleSetup& triangle{ m_Triangles[triangleIndex] };
+
+	if (triangle.isSmall)
+	{
+		RasterizeSmallTriangle<pass>(triangleIndex, clipMin, clipMax, stats);
+		return;
+	}
+
+	const int left{ std::max(triangle.left, clipMin.x) };
+	const int top{ std::max(triangle.top, clipMin.y) };
+	const int right{ std::min(triangle.right, clipMax.x) };
+	const int bottom{ std::min(triangle.bottom, clipMax.y) };
+
+	//Covered pixels have edge values up to the doubled area, but only the part inside the bounding box gets evaluated
+	const bool isSIMD{ m_IsSIMDEnabled &&
+		triangle.edge0.Max(left, top, right - 1, bottom - 1) < m_MaxSIMDEdgeValue &&
+		triangle.edge1.Max(left, top, right - 1, bottom - 1) < m_MaxSIMDEdgeValue &&
+		triangle.edge2.Max(left, top, right - 1, bottom - 1) < m_MaxSIMDEdgeValue };
+	bool isRejected{ true };
+
+	for (int tileY{ top / m_TileSize }; tileY <= (bottom - 1) / m_TileSize; ++tileY)
+	{
+		for (int tileX{ left / m_TileSize }; tileX <= (right - 1) / m_TileSize; ++tileX)
+		{
+			//Hi-Z: the whole triangle is behind everything drawn in this tile
+			if (IsBehind<pass>(triangle.minDepth, m_pTileMaxDepth[tileX + (tileY * m_TileCountX)])) continue;
+			isRejected = false;
+
+			const int tileLeft{ std::max(tileX * m_TileSize, left) };
+			const int tileTop{ std::max(tileY * m_TileSize, top) };
+			const int tileRight{ std::min((tileX + 1) * m_TileSize, right) };
+			const int tileBottom{ std::min((tileY + 1) * m_TileSize, bottom) };
+
+			//Walk the bounding box in aligned blocks, so whole blocks can be accepted or rejected at once
+			for (int blockTop{ tileTop & ~(m_BlockSize - 1) }; blockTop < tileBottom; blockTop += m_BlockSize)
+			{
+				for (int blockLeft{ tileLeft & ~(m_BlockSize - 1) }; blockLeft < tileRight; blockLeft += m_BlockSize)
+				{
+					const BlockCoverage coverage{ ClassifyBlock(triangle, blockLeft, blockTop) };
+					if (coverage == BlockCoverage::Outside) continue;
+
+					//Hi-Z: the covered part of the triangle is behind everything drawn in this block
+					const int blockIndex{ (blockLeft / m_BlockSize) + ((blockTop / m_BlockSize) * m_BlockCountX) };
+					if (IsBehind<pass>(triangle.minDepth, m_pBlockMaxDepth[blockIndex]))
+					{
+						++stats.hiZRejectedBlocks;
+						continue;
+					}
+
+					//Hi-Z: the triangle is in front of everything drawn in this block
+					const bool isDepthTestPassing{ pass != RasterPass::EqualDepth && triangle.maxDepth < m_pBlockMinDepth[blockIndex] };
+
+					const Int2 blockMin{ std::max(blockLeft, tileLeft), std::max(blockTop, tileTop) };
+					const Int2 blockMax{ std::min(blockLeft + m_BlockSize, tileRight), std::min(blockTop + m_BlockSize, tileBottom) };
+					const bool isFullyCovered{ coverage == BlockCoverage::Inside };
+
+					const DepthWrites writes{ isSIMD ?
+						RasterizeBlockAVX2<pass>(triangleIndex, blockLeft, blockMin, blockMax, isFullyCovered, isDepthTestPassing) :
+						RasterizeBlock<pass>(triangleIndex, blockMin, blockMax, isFullyCovered, isDepthTestPassing) };
+					stats.writtenSamples += writes.samples;
+
+					if (writes.samples > 0)
+					{
+						UpdateBlockDepth(blockLeft / m_BlockSize, blockTop / m_BlockSize, writes);
+					}
+				}
+			}
+		}
+	}
+
+	if (isRejected)
+	{
+		++stats.hiZRejectedTriangles;
+	}
+}
+
+template<Renderer::RasterPass pass>
+void Renderer::RasterizeSmallTriangle(uint32_t triangleIndex, const Int2& clipMin, const Int2& clipMax, RenderStats& stats) const
+{
+	const TriangleSetup& triangle{ m_Triangles[triangleIndex] };
+
+	const int left{ std::max(triangle.left, clipMin.x) };
+	const int top{ std::max(triangle.top, clipMin.y) };
+	const int right{ std::min(triangle.right, clipMax.x) };
+	const int bottom{ std::min(triangle.bottom, clipMax.y) };
+
+	bool isRejected{ true };
+
+	//The bounding box is only a few pixels, so it touches at most 4 blocks and classifying them isn't worth it
+	for (int blockTop{ top & ~(m_BlockSize - 1) }; blockTop < bottom; blockTop += m_BlockSize)
+	{
+		for (int blockLeft{ left & ~(m_BlockSize - 1) }; blockLeft < right; blockLeft += m_BlockSize)
+		{
+			//Hi-Z: the triangle is behind everything drawn in this block
+			const int blockIndex{ (blockLeft / m_BlockSize) + ((blockTop / m_BlockSize) * m_BlockCountX) };
+			if (IsBehind<pass>(triangle.minDepth, m_pBlockMaxDepth[blockIndex]))
+			{
+				++stats.hiZRejectedBlocks;
+				continue;
+			}
+			isRejected = false;
+
+			//Hi-Z: the triangle is in front of everything drawn in this block
+			const bool isDepthTestPassing{ pass != RasterPass::EqualDepth && triangle.maxDepth < m_pBlockMinDepth[blockIndex] };
+
+			const Int2 blockMin{ std::max(blockLeft, left), std::max(blockTop, top) };
+			const Int2 blockMax{ std::min(blockLeft + m_BlockSize, right), std::min(blockTop + m_BlockSize, bottom) };
+
+			const DepthWrites writes{ RasterizeBlock<pass>(triangleIndex, blockMin, blockMax, false, isDepthTestPassing) };
+			stats.writtenSamples += writes.samples;
+
+			//The tile follows once its bin is done, same as for larger triangles
+			if (writes.samples > 0)
+			{
+				UpdateBlockDepth(blockLeft / m_BlockSize, blockTop / m_BlockSize, writes);
+			}
+		}
+	}
+
+	if (isRejected)
+	{
+		++stats.hiZRejectedTriangles;
+	}
+}
+
+Renderer::BlockCoverage Renderer::ClassifyBlock(const TriangleSetup& triangle, int blockLeft, int blockTop) const
+{
+	bool isInside{ true };
+	const int64_t sampleSpread{ GetSampleSpread() };
+
+	for (const EdgeFunction* pEdge : { &triangle.edge0, &triangle.edge1, &triangle.edge2 })
+	{
+		const int blockRight{ blockLeft + m_BlockSize - 1 };
+		const int blockBottom{ blockTop + m_BlockSize - 1 };
+
+		//Samples can move the edge value away from the one at the pixel center by at most this much
+		const int64_t sampleRange{ (std::abs(pEdge->stepX) + std::abs(pEdge->stepY)) * sampleSpread / m_SubPixelSteps };
+
+		if (pEdge->Max(blockLeft, blockTop, blockRight, blockBottom) + sampleRange < 0) return BlockCoverage::Outside;
+		if (pEdge->Min(blockLeft, blockTop, blockRight, blockBottom) - sampleRange < 0) isInside = false;
+	}
+
+	return isInside ? BlockCoverage::Inside : BlockCoverage::Partial;
+}
+
+template<Renderer::RasterPass pass>
+Renderer::DepthWrites Renderer::RasterizeBlock(uint32_t triangleIndex, const Int2& blockMin, const Int2& blockMax, bool isFullyCovered, bool isDepthTestPassing) const
+{
+	const TriangleSetup& triangle{ m_Triangles[triangleIndex] };
+	DepthWrites writes{};
+
+	//Edge offsets of every sample relative to the pixel center
+	int64_t e0Sample[m_MaxSampleCount]{};
+	int64_t e1Sample[m_MaxSampleCount]{};
+	int64_t e2Sample[m_MaxSampleCount]{};
+	SetupSampleOffsets(triangle, e0Sample, e1Sample, e2Sample);
+
+	//Edge values at the first pixel, from here on only additions are needed
+	int64_t e0Row{ triangle.edge0.At(blockMin.x, blockMin.y) };
+	int64_t e1Row{ triangle.edge1.At(blockMin.x, blockMin.y) };
+	int64_t e2Row{ triangle.edge2.At(blockMin.x, blockMin.y) };
+
+	//Rows of a block are m_RowPitch apart, in the tiled buffers that is right behind each other
+	int rowIndex{ PixelIndex(blockMin.x, blockMin.y) };
+	CoarseShading cells{};
+
+	for (int py{ blockMin.y }; py < blockMax.y; ++py)
+	{
+		int64_t e0{ e0Row };
+		int64_t e1{ e1Row };
+		int64_t e2{ e2Row };
+		int pixelIndex{ rowIndex };
+
+		for (int px{ blockMin.x }; px < blockMax.x; ++px, ++pixelIndex, e0 += triangle.edge0.stepX, e1 += triangle.edge1.stepX, e2 += triangle.edge2.stepX)
+		{
+			//Every pixel is shaded at most once, no matter how many of its samples are covered
+			uint32_t color{};
+			bool isShaded{ false };
+
+			for (int sample{}; sample < m_SampleCount; ++sample)
+			{
+				const int64_t sampleE0{ e0 + e0Sample[sample] };
+				const int64_t sampleE1{ e1 + e1Sample[sample] };
+				const int64_t sampleE2{ e2 + e2Sample[sample] };
+
+				//Check if sample is inside triangle (all edge values positive)
+				if (!isFullyCovered && (sampleE0 | sampleE1 | sampleE2) < 0) continue;
+
+				const float w0{ sampleE0 * triangle.invArea };
+				const float w1{ sampleE1 * triangle.invArea };
+				const float w2{ sampleE2 * triangle.invArea };
+
+				//Calculate depth buffer, the projected depth is linear in screen space
+				const float depthBuffer = w0 * triangle.z0 + w1 * triangle.z1 + w2 * triangle.z2;
+
+				if (depthBuffer < 0 || depthBuffer > 1) continue;
+
+				const int sampleIndex{ pixelIndex + (sample * m_TiledPixelCount) };
+
+				if constexpr (pass == RasterPass::EqualDepth)
+				{
+					//Depth Test, only the surface that won the depth pass gets shaded
+					if (depthBuffer == m_pDepthBufferPixels[sampleIndex])
+					{
+						if (!isShaded)
+						{
+							color = ShadeCoarsePixel(triangleIndex, px, py, depthBuffer, cells);
+							isShaded = true;
+						}
+
+						//Update Color in Buffer
+						m_pColorBufferPixels[sampleIndex] = color;
+					}
+				}
+				//Depth Test
+				else if (const float storedDepth{ m_pDepthBufferPixels[sampleIndex] }; isDepthTestPassing || depthBuffer < storedDepth)
+				{
+					//Depth Write
+					m_pDepthBufferPixels[sampleIndex] = depthBuffer;
+					++writes.samples;
+					if (storedDepth == FLT_MAX) ++writes.clearedSamples;
+					writes.minDepth = std::min(writes.minDepth, depthBuffer);
+					writes.maxReplacedDepth = std::max(writes.maxReplacedDepth, storedDepth);
+
+					if constexpr (pass == RasterPass::Forward)
+					{
+						if (!isShaded)
+						{
+							color = ShadeCoarsePixel(triangleIndex, px, py, depthBuffer, cells);
+							isShaded = true;
+						}
+
+						//Update Color in Buffer
+						m_pColorBufferPixels[sampleIndex] = color;
+					}
+					else if constexpr (pass == RasterPass::Visibility)
+					{
+						//Only remember what is visible, shading happens once the depth buffer is final
+						m_pVisibilityBufferPixels[sampleIndex] = { triangleIndex };
+					}
+				}
+			}
+		}
+
+		e0Row += triangle.edge0.stepY;
+		e1Row += triangle.edge1.stepY;
+		e2Row += triangle.edge2.stepY;
+		rowIndex += m_RowPitch;
+	}
+
+	return writes;
+}
+
+template<Renderer::RasterPass pass>
+AVX2_FUNCTION Renderer::DepthWrites Renderer::RasterizeBlockAVX2(uint32_t triangleIndex, int blockLeft, const Int2& blockMin, const Int2& blockMax, bool isFullyCovered, bool isDepthTestPassing) const
+{
+	const TriangleSetup& triangle{ m_Triangles[triangleIndex] };
+	DepthWrites writes{};
+
+	//Nearest written and farthest replaced depth of every lane, reduced once the block is done
+	const __m256 clearDepth{ _mm256_set1_ps(FLT_MAX) };
+	__m256 minDepth{ clearDepth };
+	__m256 maxReplacedDepth{ _mm256_setzero_ps() };
+
+	//Every row of a block is exactly one group of 8 pixels
+	const __m256i laneIndex{ _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7) };
+
+	//Edge offsets of each lane relative to the first pixel of the row
+	const __m256i e0LaneStep{ _mm256_mullo_epi32(laneIndex, _mm256_set1_epi32(int32_t(triangle.edge0.stepX))) };
+	const __m256i e1LaneStep{ _mm256_mullo_epi32(laneIndex, _mm256_set1_epi32(int32_t(triangle.edge1.stepX))) };
+	const __m256i e2LaneStep{ _mm256_mullo_epi32(laneIndex, _mm256_set1_epi32(int32_t(triangle.edge2.stepX))) };
+
+	//Edge offsets of every sample relative to the pixel center
+	int64_t e0Sample[m_MaxSampleCount]{};
+	int64_t e1Sample[m_MaxSampleCount]{};
+	int64_t e2Sample[m_MaxSampleCount]{};
+	SetupSampleOffsets(triangle, e0Sample, e1Sample, e2Sample);
+
+	const __m256 invArea{ _mm256_set1_ps(triangle.invArea) };
+	const __m256 z0{ _mm256_set1_ps(triangle.z0) };
+	const __m256 z1{ _mm256_set1_ps(triangle.z1) };
+	const __m256 z2{ _mm256_set1_ps(triangle.z2) };
+
+	//Lanes outside of the bounding box get masked out
+	const __m256i pixelX{ _mm256_add_epi32(_mm256_set1_epi32(blockLeft), laneIndex) };
+	const __m256i columnMask{ _mm256_and_si256(
+		_mm256_cmpgt_epi32(pixelX, _mm256_set1_epi32(blockMin.x - 1)),
+		_mm256_cmpgt_epi32(_mm256_set1_epi32(blockMax.x), pixelX)) };
+
+	alignas(32) float depthLanes[8];
+	alignas(32) uint32_t colorLanes[8];
+	CoarseShading cells{};
+	__m256 sampleMasks[m_MaxSampleCount]{};
+
+	int64_t e0{ triangle.edge0.At(blockLeft, blockMin.y) };
+	int64_t e1{ triangle.edge1.At(blockLeft, blockMin.y) };
+	int64_t e2{ triangle.edge2.At(blockLeft, blockMin.y) };
+
+	//Rows of a block are m_RowPitch apart, in the tiled buffers that is right behind each other
+	int rowIndex{ PixelIndex(blockLeft, blockMin.y) };
+
+	for (int py{ blockMin.y }; py < blockMax.y; ++py, rowIndex += m_RowPitch, e0 += triangle.edge0.stepY, e1 += triangle.edge1.stepY, e2 += triangle.edge2.stepY)
+	{
+		//Lanes that have at least one sample passing, and the depth of the first one for shading
+		__m256 shadeMask{ _mm256_setzero_ps() };
+		__m256 shadeDepth{ _mm256_setzero_ps() };
+
+		for (int sample{}; sample < m_SampleCount; ++sample)
+		{
+			sampleMasks[sample] = _mm256_setzero_ps();
+
+			//Far away from the triangle the edge values no longer fit in 32 bits
+			//Clamping keeps their sign, and those lanes are never covered so their weights don't matter
+			const __m256i edge0{ _mm256_add_epi32(_mm256_set1_epi32(ClampEdge(e0 + e0Sample[sample])), e0LaneStep) };
+			const __m256i edge1{ _mm256_add_epi32(_mm256_set1_epi32(ClampEdge(e1 + e1Sample[sample])), e1LaneStep) };
+			const __m256i edge2{ _mm256_add_epi32(_mm256_set1_epi32(ClampEdge(e2 + e2Sample[sample])), e2LaneStep) };
+
+			//Check if samples are inside triangle
+			__m256i mask{ columnMask };
+			if (!isFullyCovered)
+			{
+				mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(edge0, edge1), edge2), _mm256_set1_epi32(-1)));
+				if (_mm256_testz_si256(mask, mask)) continue;
+			}
+
+			const __m256 w0{ _mm256_mul_ps(_mm256_cvtepi32_ps(edge0), invArea) };
+			const __m256 w1{ _mm256_mul_ps(_mm256_cvtepi32_ps(edge1), invArea) };
+			const __m256 w2{ _mm256_mul_ps(_mm256_cvtepi32_ps(edge2), invArea) };
+
+			//Calculate depth buffer, the projected depth is linear in screen space
+			const __m256 depthBuffer{ _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(w0, z0), _mm256_mul_ps(w1, z1)), _mm256_mul_ps(w2, z2)) };
+
+			__m256 depthMask{ _mm256_and_ps(_mm256_castsi256_ps(mask), _mm256_cmp_ps(depthBuffer, _mm256_setzero_ps(), _CMP_GE_OQ)) };
+			depthMask = _mm256_and_ps(depthMask, _mm256_cmp_ps(depthBuffer, _mm256_set1_ps(1.f), _CMP_LE_OQ));
+
+			//Depth Test, the stored depth is needed even when the test passes for the Hi-Z update
+			const int sampleIndex{ rowIndex + (sample * m_TiledPixelCount) };
+			float* pDepth{ m_pDepthBufferPixels + sampleIndex };
+			const __m256 storedDepth{ _mm256_maskload_ps(pDepth, _mm256_castps_si256(depthMask)) };
+			if constexpr (pass == RasterPass::EqualDepth)
+			{
+				//Only the surface that won the depth pass gets shaded
+				depthMask = _mm256_and_ps(depthMask, _mm256_cmp_ps(depthBuffer, storedDepth, _CMP_EQ_OQ));
+			}
+			else if (!isDepthTestPassing)
+			{
+				depthMask = _mm256_and_ps(depthMask, _mm256_cmp_ps(depthBuffer, storedDepth, _CMP_LT_OQ));
+			}
+
+			if (_mm256_movemask_ps(depthMask) == 0) continue;
+
+			if constexpr (pass != RasterPass::EqualDepth)
+			{
+				//Depth Write
+				_mm256_maskstore_ps(pDepth, _mm256_castps_si256(depthMask), depthBuffer);
+				writes.samples += std::popcount(uint32_t(_mm256_movemask_ps(depthMask)));
+				writes.clearedSamples += std::popcount(uint32_t(_mm256_movemask_ps(_mm256_and_ps(depthMask, _mm256_cmp_ps(storedDepth, clearDepth, _CMP_EQ_OQ)))));
+				minDepth = _mm256_min_ps(minDepth, _mm256_blendv_ps(clearDepth, depthBuffer, depthMask));
+				maxReplacedDepth = _mm256_max_ps(maxReplacedDepth, _mm256_and_ps(storedDepth, depthMask));
+			}
+
+			if constexpr (pass == RasterPass::Visibility)
+			{
+				//Only remember what is visible, shading happens once the depth buffer is final
+				_mm256_maskstore_epi32((int*)(m_pVisibilityBufferPixels + sampleIndex), _mm256_castps_si256(depthMask), _mm256_set1_epi32(int32_t(triangleIndex)));
+			}
+
+			sampleMasks[sample] = depthMask;
+			shadeDepth = _mm256_blendv_ps(shadeDepth, depthBuffer, _mm256_andnot_ps(shadeMask, depthMask));
+			shadeMask = _mm256_or_ps(shadeMask, depthMask);
+		}
+
+		if constexpr (pass == RasterPass::Forward || pass == RasterPass::EqualDepth)
+		{
+			const int laneMask{ _mm256_movemask_ps(shadeMask) };
+			if (laneMask == 0) continue;
+
+			//Shade the lanes that passed once, then write them to every sample that passed
+			_mm256_store_ps(depthLanes, shadeDepth);
+
+			for (int lane{}; lane < 8; ++lane)
+			{
+				if (laneMask & (1 << lane))
+				{
+					colorLanes[lane] = ShadeCoarsePixel(triangleIndex, blockLeft + lane, py, depthLanes[lane], cells);
+				}
+			}
+
+			const __m256i colors{ _mm256_load_si256((const __m256i*)colorLanes) };
+			for (int sample{}; sample < m_SampleCount; ++sample)
+			{
+				_mm256_maskstore_epi32((int*)m_pColorBufferPixels + rowIndex + (sample * m_TiledPixelCount), _mm256_castps_si256(sampleMasks[sample]), colors);
+			}
+		}
+	}
+
+	if (writes.samples > 0)
+	{
+		_mm256_store_ps(depthLanes, minDepth);
+		writes.minDepth = *std::min_element(depthLanes, depthLanes + 8);
+		_mm256_store_ps(depthLanes, maxReplacedDepth);
+		writes.maxReplacedDepth = *std::max_element(depthLanes, depthLanes + 8);
+	}
+
+	return writes;
+}
+
+void Renderer::SetupSampleOffsets(const TriangleSetup& triangle, int64_t* pE0, int64_t* pE1, int64_t* pE2) const
+{
+	for (int sample{}; sample < m_SampleCount; ++sample)
+	{
+		//The steps are per pixel, sample positions are in sub pixel steps
+		const Int2 position{ GetSamplePosition(sample) };
+		pE0[sample] = (triangle.edge0.stepX * position.x + triangle.edge0.stepY * position.y) / m_SubPixelSteps;
+		pE1[sample] = (triangle.edge1.stepX * position.x + triangle.edge1.stepY * position.y) / m_SubPixelSteps;
+		pE2[sample] = (triangle.edge2.stepX * position.x + triangle.edge2.stepY * position.y) / m_SubPixelSteps;
+	}
+}
+
+Int2 Renderer::GetSamplePosition(int sample) const
+{
+	//A single sample sits in the pixel center
+	if (m_SampleCount == 1) return {};
+	return m_SamplePositions[sample];
+}
+
+int64_t Renderer::GetSampleSpread() const
+{
+	return m_SampleCount == 1 ? 0 : m_MaxSampleOffset;
+}
+
+template<Renderer::RasterPass pass>
+bool Renderer::IsBehind(float nearestDepth, float storedFarthestDepth)
+{
+	//The equal depth pass still has to shade the pixels that wrote the farthest depth
+	if constexpr (pass == RasterPass::EqualDepth)
+	{
+		return nearestDepth > storedFarthestDepth;
+	}
+	else
+	{
+		return nearestDepth >= storedFarthestDepth;
+	}
+}
+
+void Renderer::UpdateBlockDepth(int blockX, int blockY, const DepthWrites& writes) const
+{
+	//Depths only ever get closer, the nearest one follows from what got written
+	const int blockIndex{ blockX + (blockY * m_BlockCountX) };
+	m_pBlockMinDepth[blockIndex] = std::min(m_pBlockMinDepth[blockIndex], writes.minDepth);
+
+	//The farthest depth stays FLT_MAX as long as a sample of the block holds none
+	const int left{ blockX * m_BlockSize };
+	const int top{ blockY * m_BlockSize };
+	const int right{ std::min(left + m_BlockSize, m_Width) };
+	const int bottom{ std::min(top + m_BlockSize, m_Height) };
+	m_pBlockDepthSamples[blockIndex] += uint16_t(writes.clearedSamples);
+	if (m_pBlockDepthSamples[blockIndex] < (right - left) * (bottom - top) * m_SampleCount) return;
+
+	//Every written depth is closer than the one it replaced, so the farthest one only moves when it got replaced itself
+	if (writes.maxReplacedDepth < m_pBlockMaxDepth[blockIndex]) return;
+
+	float maxDepth{ 0.f };
+	const int pixelIndex{ PixelIndex(left, top) };
+	for (int sample{}; sample < m_SampleCount; ++sample)
+	{
+		const float* pDepth{ m_pDepthBufferPixels + pixelIndex + (sample * m_TiledPixelCount) };
+		for (int py{ top }; py < bottom; ++py, pDepth += m_RowPitch)
+		{
+			for (int px{}; px < right - left; ++px)
+			{
+				maxDepth = std::max(maxDepth, pDepth[px]);
+			}
+		}
+	}
+
+	const float oldMaxDepth{ m_pBlockMaxDepth[blockIndex] };
+	m_pBlockMaxDepth[blockIndex] = maxDepth;
+
+	//Same for the tile, it keeps FLT_MAX until all of its blocks are done with it, then only the block that held its farthest depth can lower it
+	const int blocksPerTile{ m_TileSize / m_BlockSize };
+	const int tileX{ blockX / blocksPerTile };
+	const int tileY{ blockY / blocksPerTile };
+	const int tileIndex{ tileX + (tileY * m_TileCountX) };
+	if (oldMaxDepth == FLT_MAX)
+	{
+		const int tileBlockCount{ std::min(blocksPerTile, m_BlockCountX - (tileX * blocksPerTile)) * std::min(blocksPerTile, m_BlockCountY - (tileY * blocksPerTile)) };
+		if (++m_pTileDepthBlocks[tileIndex] < tileBlockCount) return;
+	}
+	else if (oldMaxDepth < m_pTileMaxDepth[tileIndex]) return;
+
+	UpdateTileDepth(tileX, tileY);
+}
+
+void Renderer::UpdateTileDepth(int tileX, int tileY) const
+{
+	const int blocksPerTile{ m_TileSize / m_BlockSize };
+	const int left{ tileX * blocksPerTile };
+	const int top{ tileY * blocksPerTile };
+	const int right{ std::min(left + blocksPerTile, m_BlockCountX) };
+	const int bottom{ std::min(top + blocksPerTile, m_BlockCountY) };
+
+	float minDepth{ FLT_MAX };
+	float maxDepth{ 0.f };
+	for (int blockY{ top }; blockY < bottom; ++blockY)
+	{
+		for (int blockX{ left }; blockX < right; ++blockX)
+		{
+			minDepth = std::min(minDepth, m_pBlockMinDepth[blockX + (blockY * m_BlockCountX)]);
+			maxDepth = std::max(maxDepth, m_pBlockMaxDepth[blockX + (blockY * m_BlockCountX)]);
+		}
+	}
+
+	m_pTileMinDepth[tileX + (tileY * m_TileCountX)] = minDepth;
+	m_pTileMaxDepth[tileX + (tileY * m_TileCountX)] = maxDepth;
+}
+
+int32_t Renderer::ClampEdge(int64_t value)
+{
+	const int64_t limit{ 1 << 30 };
+	return int32_t(std::max(-limit, std::min(value, limit)));
+}
+
+uint32_t Renderer::ShadeCoarsePixel(uint32_t triangleIndex, int px, int py, float depthBuffer, CoarseShading& cells) const
+{
+	const TriangleSetup& triangle{ m_Triangles[triangleIndex] };
+	const int rate{ m_pShadingRates[(px / m_BlockSize) + ((py / m_BlockSize) * m_BlockCountX)] };
+	if (rate == 1) return ShadePixel(triangle, float(px), float(py), depthBuffer);
+
+	const int cell{ ((px % m_BlockSize) / rate) + (((py % m_BlockSize) / rate) * (m_BlockSize / rate)) };
+	const uint32_t cellBit{ 1u << cell };
+
+	if (!(cells.shadedCells & cellBit) || cells.triangleIndices[cell] != triangleIndex)
+	{
+		//Shaded in the center of the cell, no matter which of its pixels comes first
+		const float cellX{ float(px - (px % rate)) + ((rate - 1) * .5f) };
+		const float cellY{ float(py - (py % rate)) + ((rate - 1) * .5f) };
+
+		cells.colors[cell] = ShadePixel(triangle, cellX, cellY, depthBuffer);
+		cells.triangleIndices[cell] = triangleIndex;
+		cells.shadedCells |= cellBit;
+	}
+
+	return cells.colors[cell];
+}
+
+uint32_t Renderer::ShadePixel(const TriangleSetup& triangle, float px, float py, float depthBuffer) const
+{
+	ColorRGB finalColor{};
+	if (m_ShowFinalColor)
+	{
+		//The planes start at the top left of the bounding box
+		const float dx{ px - triangle.left };
+		const float dy{ py - triangle.top };
+
+		//Depth correction
+		const float w{ 1.f / triangle.invW.At(dx, dy) };
+
+		//Only interpolate what the active shader reads
+		Vertex_Out temp{};
+		temp.position.x = px;
+		temp.position.y = py;
+
+		if (m_IsNormalMap || m_LightingMode != LightingMode::ObservedArea)
+		{
+			temp.uv = { triangle.u.At(dx, dy) * w, triangle.v.At(dx, dy) * w };
+		}
+
+		//Both directions get normalized, so they don't need the depth correction
+		temp.normal = Vector3{ triangle.normal[0].At(dx, dy), triangle.normal[1].At(dx, dy), triangle.normal[2].At(dx, dy) }.Normalized();
+		if (m_IsNormalMap)
+		{
+			temp.tangent = Vector3{ triangle.tangent[0].At(dx, dy), triangle.tangent[1].At(dx, dy), triangle.tangent[2].At(dx, dy) }.Normalized();
+		}
+
+		finalColor = PixelShading(temp);
+	}
+	else
+	{
+		//Remap the depthbuffer to avoid having everything in white
+		Remap(depthBuffer, 0.985f, 1.f);
+
+		//Clamp the depthbuffer to prevent negative values
+		depthBuffer = Clamp(depthBuffer, 0.f, 1.f);
+
+		finalColor = { depthBuffer,depthBuffer,depthBuffer };
+	}
+
+	//Update Color in Buffer
+	finalColor.MaxToOne();
+
+	return SDL_MapRGB(m_pBackBuffer->format,
+		static_cast<uint8_t>(finalColor.r * 255),
+		static_cast<uint8_t>(finalColor.g * 255),
+		static_cast<uint8_t>(finalColor.b * 255));
+}
+
+ColorRGB Renderer::PixelShading(const Vertex_Out& v) const
+{
+	Vector3 lightDirection{ .577f, -.577f, .577f };
+	float lightIntensity{ 7.f };
+	float shininess{ 25.f };
+	ColorRGB finalColor{ 0.025f, 0.025f, 0.025f };
+
+	Vector3 normal{ v.normal };
+	Vector3 viewDirection{};
+
+	const int px = (int)v.position.x;
+	const int py = (int)v.position.y;
+
+	//calculate view direction
+	if (m_LightingMode == LightingMode::Specular || m_LightingMode == LightingMode::Combined)
+	{
+		float rx = px + 0.5f;
+		float ry = py + 0.5f;
+
+		float cx = (2 * (rx / float(m_Width)) - 1) * m_AspectRatio * m_Camera.fov;
+		float cy = (1 - (2 * (ry / float(m_Height)))) * m_Camera.fov;
+
+		viewDirection = (cx * m_Camera.right + cy * m_Camera.up + m_Camera.forward).Normalized();
+	}
+
+	//Normal map
+	if (m_IsNormalMap)
+	{
+		Vector3 binormal = Vector3::Cross(v.normal, v.tangent);
+		Matrix tangentSpaceAxis{ v.tangent, binormal, v.normal, Vector3::Zero };
+
+		ColorRGB sampledColor = m_pTexNormal->Sample(v.uv);
+		sampledColor = (2.f * sampledColor) - ColorRGB{ 1.f, 1.f, 1.f };
+
+		normal = tangentSpaceAxis.TransformVector(sampledColor.r, sampledColor.g, sampledColor.b);
+	}
+
+	//Observed area (lambert cosine law)
+	float dotProduct = normal * -lightDirection;
+	if (dotProduct >= 0.f)
+	{
+		switch (m_LightingMode)
+		{
+		case LightingMode::ObservedArea:
+			finalColor += { dotProduct, dotProduct, dotProduct };
+			break;
+
+		case LightingMode::Diffuse:
+			finalColor += Lambert(lightIntensity, m_pTexDiffuse->Sample(v.uv)) * dotProduct;
+			break;
+
+		case LightingMode::Specular:
+			finalColor += Phong(m_pTexSpecular->Sample(v.uv), shininess * m_pTexGloss->Sample(v.uv).r, -lightDirection, viewDirection, normal) * dotProduct;
+			break;
+
+		case LightingMode::Combined:
+			finalColor += Lambert(lightIntensity, m_pTexDiffuse->Sample(v.uv)) * dotProduct;
+			finalColor += Phong(m_pTexSpecular->Sample(v.uv), shininess * m_pTexGloss->Sample(v.uv).r, -lightDirection, viewDirection, normal) * dotProduct;
+			break;
+		}
+	}
+
+	return finalColor;
+}
+
+void Renderer::TransformMesh(const DrawCall& draw)
+{
+	Mesh& mesh{ *draw.pMesh };
+	UpdateTransformCache(mesh, draw.worldMatrix);
+
+	//Outputs transformed with the current versions of both matrices are reused as they are
+	const auto getWork = [&mesh](const TransformVersion& outputVersion)
+		{
+			return TransformWork{ outputVersion.positions != mesh.version.positions, outputVersion.directions != mesh.version.directions };
+		};
+	const auto countWork = [this](const TransformWork& work, uint32_t vertexCount)
+		{
+			if (!work.isPositions && !work.isDirections)
+			{
+				++m_Stats.transformCacheHits;
+				return false;
+			}
+
+			++m_Stats.transformCacheMisses;
+			if (!work.isDirections) ++m_Stats.transformCachePositionMisses;
+			m_Stats.transformedVertices += vertexCount;
+			return true;
+		};
+
+	if (mesh.meshlets.empty())
+	{
+		const TransformWork work{ getWork(mesh.outputVersions[0]) };
+		if (countWork(work, uint32_t(mesh.vertices.size())))
+		{
+			VertexTransformationFunction(mesh, draw.worldMatrix, work);
+			mesh.outputVersions[0] = mesh.version;
+		}
+		return;
+	}
+
+	CullMeshlets(draw);
+	m_MeshletWork.clear();
+	for (uint32_t meshletIndex : m_VisibleMeshlets)
+	{
+		const TransformWork work{ getWork(mesh.outputVersions[meshletIndex]) };
+		if (countWork(work, mesh.meshlets[meshletIndex].vertexCount))
+		{
+			m_MeshletWork.push_back(MeshletWork{ meshletIndex, work });
+			mesh.outputVersions[meshletIndex] = mesh.version;
+		}
+	}
+	VertexTransformationFunction(mesh, draw.worldMatrix, m_MeshletWork);
+}
+
+void Renderer::UpdateTransformCache(Mesh& mesh, const Matrix& worldMatrix) const
+{
+	//Outputs that were never transformed hold version 0, the mesh starts at version 1
+	const size_t outputCount{ std::max(mesh.meshlets.size(), size_t(1)) };
+	if (mesh.outputVersions.size() != outputCount)
+	{
+		mesh.outputVersions.assign(outputCount, TransformVersion{});
+	}
+
+	const Matrix worldViewProjectionMatrix{ worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix };
+	if (worldViewProjectionMatrix != mesh.cachedWorldViewProjectionMatrix)
+	{
+		mesh.cachedWorldViewProjectionMatrix = worldViewProjectionMatrix;
+		++mesh.version.positions;
+	}
+	if (worldMatrix != mesh.cachedWorldMatrix)
+	{
+		mesh.cachedWorldMatrix = worldMatrix;
+		++mesh.version.directions;
+	}
+}
+
+void Renderer::CullMeshlets(const DrawCall& draw)
+{
+	const Mesh& mesh{ *draw.pMesh };
+	m_VisibleMeshlets.clear();
+	m_Stats.meshlets += uint32_t(mesh.meshlets.size());
+
+	//Culling happens in object space, a clip plane is a combination of the columns of the world view projection matrix
+	//Left, right, bottom, top, near and far, normalized so the distance to a sphere center can be compared with its radius
+	const Matrix worldViewProjectionMatrix{ draw.worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix };
+	const Vector4 columnX{ worldViewProjectionMatrix[0].x, worldViewProjectionMatrix[1].x, worldViewProjectionMatrix[2].x, worldViewProjectionMatrix[3].x };
+	const Vector4 columnY{ worldViewProjectionMatrix[0].y, worldViewProjectionMatrix[1].y, worldViewProjectionMatrix[2].y, worldViewProjectionMatrix[3].y };
+	const Vector4 columnZ{ worldViewProjectionMatrix[0].z, worldViewProjectionMatrix[1].z, worldViewProjectionMatrix[2].z, worldViewProjectionMatrix[3].z };
+	const Vector4 columnW{ worldViewProjectionMatrix[0].w, worldViewProjectionMatrix[1].w, worldViewProjectionMatrix[2].w, worldViewProjectionMatrix[3].w };
+
+	Vector4 planes[6]{ columnW + columnX, columnW - columnX, columnW + columnY, columnW - columnY, columnZ, columnW - columnZ };
+	for (Vector4& plane : planes)
+	{
+		plane = plane * (1.f / plane.GetXYZ().Magnitude());
+	}
+
+	const Vector3 cameraPosition{ Matrix::Inverse(draw.worldMatrix).TransformPoint(m_Camera.origin) };
+
+	for (uint32_t meshletIndex{}; meshletIndex < uint32_t(mesh.meshlets.size()); ++meshletIndex)
+	{
+		const Meshlet& meshlet{ mesh.meshlets[meshletIndex] };
+
+		if (m_IsMeshletCulling)
+		{
+			bool isOutside{ false };
+			for (const Vector4& plane : planes)
+			{
+				if (Vector3::Dot(plane.GetXYZ(), meshlet.center) + plane.w < -meshlet.radius) isOutside = true;
+			}
+
+			if (isOutside)
+			{
+				++m_Stats.offscreenMeshlets;
+				continue;
+			}
+
+			//The cone only describes the front faces, meshlets of meshes that cull front faces or nothing are never rejected by it
+			if (mesh.cullMode == CullMode::Back && Vector3::Dot((meshlet.coneApex - cameraPosition).Normalized(), meshlet.coneAxis) >= meshlet.coneCutoff)
+			{
+				++m_Stats.backFacingMeshlets;
+				continue;
+			}
+		}
+
+		m_VisibleMeshlets.push_back(meshletIndex);
+	}
+}
+
+void Renderer::VertexTransformationFunction(Mesh& mesh, const Matrix& worldMatrix, TransformWork work) const
+{
+	if (mesh.vertex_streams.positionX.empty())
+	{
+		VertexTransformationFunction(mesh.vertices, mesh.vertices_out, worldMatrix, work);
+	}
+	else
+	{
+		VertexTransformationFunction(mesh.vertex_streams, mesh.vertex_streams_out, worldMatrix, work);
+	}
+}
+
+void Renderer::VertexTransformationFunction(const std::vector<Vertex>& vertices_in, std::vector<Vertex_Out>& vertices_out, const Matrix& worldMatrix, TransformWork work) const
+{
+	const Matrix worldViewProjectionMatrix{ worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix };
+
+	//Only allocates when the mesh grew, every vertex gets overwritten below
+	vertices_out.resize(vertices_in.size());
+
+	//Vertices don't depend on each other, chunks of them get transformed in parallel straight into their place in vertices_out
+	const size_t chunkSize{ size_t(m_VertexChunkSize) };
+	const uint32_t chunkCount{ uint32_t((vertices_in.size() + chunkSize - 1) / chunkSize) };
+	m_pThreadPool->ParallelFor(chunkCount, [&](uint32_t chunk)
+		{
+			TransformVertices(vertices_in, vertices_out, worldMatrix, worldViewProjectionMatrix, chunk * chunkSize, std::min((chunk + 1) * chunkSize, vertices_in.size()), work);
+		});
+}
+
+void Renderer::VertexTransformationFunction(const VertexStreams& streams_in, VertexStreams& streams_out, const Matrix& worldMatrix, TransformWork work) const
+{
+	const Matrix worldViewProjectionMatrix{ worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix };
+	const size_t count{ streams_in.positionX.size() };
+	ResizeVertexStreams(streams_out, count);
+
+	//Chunks are a multiple of 8 vertices, so every SIMD group stays inside one chunk
+	const size_t chunkSize{ size_t(m_VertexChunkSize) };
+	const uint32_t chunkCount{ uint32_t((count + chunkSize - 1) / chunkSize) };
+	m_pThreadPool->ParallelFor(chunkCount, [&](uint32_t chunk)
+		{
+			TransformVertexStreams(streams_in, streams_out, worldMatrix, worldViewProjectionMatrix, chunk * chunkSize, std::min((chunk + 1) * chunkSize, count), work);
+		});
+}
+
+void Renderer::VertexTransformationFunction(Mesh& mesh, const Matrix& worldMatrix, const std::vector<MeshletWork>& meshlets) const
+{
+	const Matrix worldViewProjectionMatrix{ worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix };
+	const bool isStreams{ !mesh.vertex_streams.positionX.empty() };
+
+	//Vertices of other meshlets keep whatever they held, they are either culled or still valid in the transform cache
+	if (isStreams)
+	{
+		ResizeVertexStreams(mesh.vertex_streams_out, mesh.vertex_streams.positionX.size());
+	}
+	else
+	{
+		mesh.vertices_out.resize(mesh.vertices.size());
+	}
+
+	//Meshlets are small, every job takes as many of them as fit in a chunk
+	//Their vertex ranges follow each other, so runs of meshlets that need the same work go through the kernels as one range
+	const size_t meshletsPerJob{ std::max(size_t(m_VertexChunkSize) / 64, size_t(1)) };
+	const uint32_t jobCount{ uint32_t((meshlets.size() + meshletsPerJob - 1) / meshletsPerJob) };
+	m_pThreadPool->ParallelFor(jobCount, [&](uint32_t job)
+		{
+			const auto transformRange = [&](size_t begin, size_t end, TransformWork work)
+				{
+					if (begin == end) return;
+					if (isStreams)
+					{
+						TransformVertexStreams(mesh.vertex_streams, mesh.vertex_streams_out, worldMatrix, worldViewProjectionMatrix, begin, end, work);
+					}
+					else
+					{
+						TransformVertices(mesh.vertices, mesh.vertices_out, worldMatrix, worldViewProjectionMatrix, begin, end, work);
+					}
+				};
+
+			size_t rangeBegin{};
+			size_t rangeEnd{};
+			TransformWork rangeWork{};
+			for (size_t i{ job * meshletsPerJob }; i < std::min((job + 1) * meshletsPerJob, meshlets.size()); ++i)
+			{
+				const Meshlet& meshlet{ mesh.meshlets[meshlets[i].meshlet] };
+
+				const size_t end{ size_t(meshlet.vertexOffset) + meshlet.vertexCount };
+				if (meshlet.vertexOffset != rangeEnd || meshlets[i].work != rangeWork)
+				{
+					transformRange(rangeBegin, rangeEnd, rangeWork);
+					rangeBegin = meshlet.vertexOffset;
+					rangeWork = meshlets[i].work;
+				}
+				rangeEnd = end;
+			}
+			transformRange(rangeBegin, rangeEnd, rangeWork);
+		});
+}
+
+void Renderer::TransformVertices(const std::vector<Vertex>& vertices_in, std::vector<Vertex_Out>& vertices_out, const Matrix& worldMatrix, const Matrix& worldViewProjectionMatrix, size_t begin, size_t end, TransformWork work) const
+{
+	for (size_t i{ begin }; i < end; ++i)
+	{
+		Vertex_Out& v{ vertices_out[i] };
+
+		//Position calculations
+		//Stays in clip space, the perspective divide happens after clipping
+		if (work.isPositions)
+		{
+			v.position = worldViewProjectionMatrix.TransformPoint({ vertices_in[i].position, 1.f });
+		}
+
+		//Set other variables
+		if (work.isDirections)
+		{
+			v.color = vertices_in[i].color;
+			v.uv = vertices_in[i].uv;
+			v.normal = worldMatrix.TransformVector(vertices_in[i].normal);
+			v.tangent = worldMatrix.TransformVector(vertices_in[i].tangent);
+		}
+	}
+}
+
+void Renderer::TransformVertexStreams(const VertexStreams& streams_in, VertexStreams& streams_out, const Matrix& worldMatrix, const Matrix& worldViewProjectionMatrix, size_t begin, size_t end, TransformWork work) const
+{
+	//The SIMD kernel takes whole groups of 8, the few vertices left over go through the scalar loop
+	if (m_IsSIMDEnabled)
+	{
+		const size_t simdEnd{ begin + ((end - begin) & ~size_t(7)) };
+		TransformVertexStreamsAVX2(streams_in, streams_out, worldMatrix, worldViewProjectionMatrix, begin, simdEnd, work);
+		begin = simdEnd;
+	}
+
+	for (size_t i{ begin }; i < end; ++i)
+	{
+		if (work.isPositions)
+		{
+			const Vector4 position{ worldViewProjectionMatrix.TransformPoint(streams_in.positionX[i], streams_in.positionY[i], streams_in.positionZ[i], 1.f) };
+			streams_out.positionX[i] = position.x;
+			streams_out.positionY[i] = position.y;
+			streams_out.positionZ[i] = position.z;
+			streams_out.positionW[i] = position.w;
+		}
+		if (!work.isDirections) continue;
+
+		const Vector3 normal{ worldMatrix.TransformVector(streams_in.normalX[i], streams_in.normalY[i], streams_in.normalZ[i]) };
+		const Vector3 tangent{ worldMatrix.TransformVector(streams_in.tangentX[i], streams_in.tangentY[i], streams_in.tangentZ[i]) };
+		streams_out.normalX[i] = normal.x;
+		streams_out.normalY[i] = normal.y;
+		streams_out.normalZ[i] = normal.z;
+		streams_out.tangentX[i] = tangent.x;
+		streams_out.tangentY[i] = tangent.y;
+		streams_out.tangentZ[i] = tangent.z;
+	}
+}
+
+AVX2_FUNCTION void Renderer::TransformVertexStreamsAVX2(const VertexStreams& streams_in, VertexStreams& streams_out, const Matrix& worldMatrix, const Matrix& worldViewProjectionMatrix, size_t begin, size_t end, TransformWork work) const
+{
+	//Every matrix element is broadcast once, then 8 vertices go through the same multiplies and adds as Matrix::TransformPoint and TransformVector
+	//No fused multiply add, so both paths give the same results
+	//Meshlets call this for a few dozen vertices at a time, so the setup stays cheap: rows are read once, since the accessors aren't inlined,
+	//and the arrays are left uninitialized, every element gets written right away
+	__m256 wvp[4][4];
+	__m256 world[3][3];
+	for (int row{}; row < 4; ++row)
+	{
+		const Vector4 wvpRow{ worldViewProjectionMatrix[row] };
+		wvp[row][0] = _mm256_set1_ps(wvpRow.x);
+		wvp[row][1] = _mm256_set1_ps(wvpRow.y);
+		wvp[row][2] = _mm256_set1_ps(wvpRow.z);
+		wvp[row][3] = _mm256_set1_ps(wvpRow.w);
+
+		if (row == 3) continue;
+		const Vector4 worldRow{ worldMatrix[row] };
+		world[row][0] = _mm256_set1_ps(worldRow.x);
+		world[row][1] = _mm256_set1_ps(worldRow.y);
+		world[row][2] = _mm256_set1_ps(worldRow.z);
+	}
+
+	for (size_t i{ begin }; i < end; i += 8)
+	{
+		if (work.isPositions)
+		{
+			const __m256 x{ _mm256_loadu_ps(&streams_in.positionX[i]) };
+			const __m256 y{ _mm256_loadu_ps(&streams_in.positionY[i]) };
+			const __m256 z{ _mm256_loadu_ps(&streams_in.positionZ[i]) };
+			float* pPosition[4]{ &streams_out.positionX[i], &streams_out.positionY[i], &streams_out.positionZ[i], &streams_out.positionW[i] };
+			for (int column{}; column < 4; ++column)
+			{
+				const __m256 result{ _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wvp[0][column], x), _mm256_mul_ps(wvp[1][column], y)), _mm256_mul_ps(wvp[2][column], z)), wvp[3][column]) };
+				_mm256_storeu_ps(pPosition[column], result);
+			}
+		}
+		if (!work.isDirections) continue;
+
+		TransformVectors(world, &streams_in.normalX[i], &streams_in.normalY[i], &streams_in.normalZ[i], &streams_out.normalX[i], &streams_out.normalY[i], &streams_out.normalZ[i]);
+		TransformVectors(world, &streams_in.tangentX[i], &streams_in.tangentY[i], &streams_in.tangentZ[i], &streams_out.tangentX[i], &streams_out.tangentY[i], &streams_out.tangentZ[i]);
+	}
+}
+
+void Renderer::ToggleFinalColor()
+{
+	m_ShowFinalColor = !m_ShowFinalColor;
+	m_IsDirty = true;
+}
+
+void Renderer::ToggleRotation()
+{
+	m_IsRotating = !m_IsRotating;
+}
+
+void Renderer::SetRotation(float rotation)
+{
+	//The world matrix is part of the draw list, the next frame notices the change on its own
+	m_Rotation = rotation;
+}
+
+void Renderer::ToggleNormalMap()
+{
 	m_IsNormalMap = !m_IsNormalMap;
+	m_IsDirty = true;
 }
 
 void Renderer::CycleLightingMode()
 {
 	m_LightingMode = LightingMode(((int)m_LightingMode + 1) % (int)LightingMode::End);
+	m_IsDirty = true;
+}
+
+void Renderer::CycleShadingMode()
+{
+	m_ShadingMode = ShadingMode(((int)m_ShadingMode + 1) % (int)ShadingMode::End);
+	m_IsDirty = true;
+
+	switch (m_ShadingMode)
+	{
+	case ShadingMode::Forward:
+		std::cout << "Shading mode: Forward" << std::endl;
+		break;
+
+	case ShadingMode::Deferred:
+		std::cout << "Shading mode: Deferred (visibility buffer)" << std::endl;
+		break;
+
+	case ShadingMode::DepthPrepass:
+		std::cout << "Shading mode: Depth pre-pass" << std::endl;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void Renderer::ToggleSIMD()
+{
+	if (!m_IsAVX2Supported)
+	{
+		std::cout << "SIMD rasterization needs AVX2, which is not supported on this CPU" << std::endl;
+		return;
+	}
+
+	m_IsSIMDEnabled = !m_IsSIMDEnabled;
+	std::cout << "SIMD rasterization: " << (m_IsSIMDEnabled ? "AVX2" : "Scalar") << std::endl;
+}
+
+void Renderer::ToggleMeshOptimization()
+{
+	//The exported order only comes back by loading the mesh again
+	m_Mesh.isCacheOptimized = !m_Mesh.isCacheOptimized;
+	LoadMesh(m_MeshFilename, m_Mesh);
+	m_IsDirty = true;
+	std::cout << "Mesh optimization: " << (m_Mesh.isCacheOptimized ? "On" : "Off") << std::endl;
+}
+
+void Renderer::ToggleTiledLayout()
+{
+	m_IsTiledLayout = !m_IsTiledLayout;
+	SetRenderResolution(m_Width, m_Height);
+	m_IsDirty = true;
+	std::cout << "Render target layout: " << (m_IsTiledLayout ? "Tiled" : "Linear") << std::endl;
+}
+
+void Renderer::ToggleMSAA()
+{
+	m_SampleCount = m_SampleCount == 1 ? m_MaxSampleCount : 1;
+	m_IsDirty = true;
+	std::cout << "MSAA: " << (m_SampleCount == 1 ? "Off" : "4x") << std::endl;
+}
+
+void Renderer::ToggleOcclusionCulling()
+{
+	m_IsOcclusionCulling = !m_IsOcclusionCulling;
+	std::cout << "Occlusion culling: " << (m_IsOcclusionCulling ? "On" : "Off") << std::endl;
+}
+
+void Renderer::ToggleDynamicResolution()
+{
+	m_IsDynamicResolution = !m_IsDynamicResolution;
+	if (!m_IsDynamicResolution)
+	{
+		SetResolutionScale(1.f);
+	}
+	std::cout << "Dynamic resolution: " << (m_IsDynamicResolution ? "On" : "Off") << ", target " << m_TargetFrameTime * 1000.f << " ms" << std::endl;
+}
+
+void Renderer::SetTargetFrameTime(float seconds)
+{
+	m_TargetFrameTime = seconds;
+	m_FramesSinceResolutionChange = 0;
+}
+
+void Renderer::ToggleMeshletCulling()
+{
+	m_IsMeshletCulling = !m_IsMeshletCulling;
+	std::cout << "Meshlet culling: " << (m_IsMeshletCulling ? "On" : "Off") << std::endl;
+}
+
+void Renderer::CycleShadingRateMode()
+{
+	m_ShadingRateMode = ShadingRateMode(((int)m_ShadingRateMode + 1) % (int)ShadingRateMode::End);
+	m_IsDirty = true;
+
+	//The variance rates only get written by the next resolve
+	std::fill_n(m_pShadingRates, m_BlockCountX * m_BlockCountY, uint8_t(1));
+
+	switch (m_ShadingRateMode)
+	{
+	case ShadingRateMode::Full:
+		std::cout << "Shading rate: Full" << std::endl;
+		break;
+
+	case ShadingRateMode::Variance:
+		std::cout << "Shading rate: Variable (previous frame contrast)" << std::endl;
+		break;
+
+	case ShadingRateMode::Foveated:
+		std::cout << "Shading rate: Variable (foveated)" << std::endl;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void Renderer::CycleThreadCount()
+{
+	const uint32_t maxThreadCount{ std::max(std::thread::hardware_concurrency(), 1u) };
+	const uint32_t threadCount{ m_pThreadPool->GetThreadCount() };
+
+	SetThreadCount(threadCount >= maxThreadCount ? 1 : std::min(threadCount * 2, maxThreadCount));
+	std::cout << "Thread count: " << m_pThreadPool->GetThreadCount() << std::endl;
+}
+
+void Renderer::SetThreadCount(uint32_t threadCount)
+{
+	delete m_pThreadPool;
+	m_pThreadPool = new ThreadPool(threadCount);
+}
+
+void Renderer::PrintStats() const
+{
+	std::cout << "Culled: " << m_Stats.culledTriangles << " triangles, clipped: " << m_Stats.clippedTriangles << " triangles" << std::endl;
+	const uint32_t setupTriangles{ uint32_t(m_Triangles.size()) + m_Stats.smallTrianglesCulled };
+	std::cout << "Small triangle fast path: " << m_Stats.smallTriangles << " of " << setupTriangles << " triangles ("
+		<< (setupTriangles > 0 ? 100.f * m_Stats.smallTriangles / setupTriangles : 0.f) << "%), "
+		<< m_Stats.smallTrianglesCulled << " culled without covering a pixel" << std::endl;
+	std::cout << "Resolution: " << m_Width << "x" << m_Height << " (" << m_ResolutionScale * 100.f << "% of " << m_WindowWidth << "x" << m_WindowHeight << ")" << std::endl;
+	std::cout << "Occlusion culled: " << m_Stats.occludedMeshes << " meshes, " << m_Stats.offscreenMeshes << " more were off-screen" << std::endl;
+	std::cout << "Meshlets culled: " << m_Stats.offscreenMeshlets << " off-screen, " << m_Stats.backFacingMeshlets << " back-facing, of " << m_Stats.meshlets
+		<< ", " << m_Stats.transformedVertices << " vertices transformed" << std::endl;
+	std::cout << "Transform cache: " << m_Stats.transformCacheHits << " hits, " << m_Stats.transformCacheMisses << " misses, "
+		<< m_Stats.transformCachePositionMisses << " of them kept their normals and tangents" << std::endl;
+	std::cout << "Hi-Z rejected: " << m_Stats.hiZRejectedTriangles << " triangles, " << m_Stats.hiZRejectedBlocks << " blocks" << std::endl;
+
+	//The depth buffer still holds the last frame, every sample that isn't cleared is visible
+	const uint32_t visibleSamples{ uint32_t(m_TiledPixelCount * m_SampleCount - std::count(m_pDepthBufferPixels, m_pDepthBufferPixels + m_TiledPixelCount * m_SampleCount, FLT_MAX)) };
+	std::cout << "Overdraw: " << m_Stats.writtenSamples << " samples written for " << visibleSamples << " visible ("
+		<< (visibleSamples > 0 ? m_Stats.writtenSamples / float(visibleSamples) : 0.f) << "x)" << std::endl;
+}
+
+Renderer::RenderStats& Renderer::RenderStats::operator+=(const RenderStats& stats)
+{
+	culledTriangles += stats.culledTriangles;
+	clippedTriangles += stats.clippedTriangles;
+	smallTriangles += stats.smallTriangles;
+	smallTrianglesCulled += stats.smallTrianglesCulled;
+	occludedMeshes += stats.occludedMeshes;
+	offscreenMeshes += stats.offscreenMeshes;
+	meshlets += stats.meshlets;
+	offscreenMeshlets += stats.offscreenMeshlets;
+	backFacingMeshlets += stats.backFacingMeshlets;
+	transformedVertices += stats.transformedVertices;
+	transformCacheHits += stats.transformCacheHits;
+	transformCacheMisses += stats.transformCacheMisses;
+	transformCachePositionMisses += stats.transformCachePositionMisses;
+	hiZRejectedTriangles += stats.hiZRejectedTriangles;
+	hiZRejectedBlocks += stats.hiZRejectedBlocks;
+	writtenSamples += stats.writtenSamples;
+	return *this;
 }
 
 bool Renderer::SaveBufferToImage() const
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cfloat>
 #include <cstdint>
+#include <string>
 #include <vector>
 
 #include "Camera.h"
@@ -14,6 +16,7 @@ namespace dae
 	class Texture;
 	class Timer;
 	class Scene;
+	class ThreadPool;
 
 	class Renderer final
 	{
@@ -29,12 +32,65 @@ namespace dae
 		void Update(Timer* pTimer);
 		void Render();
 
+		//Adds a mesh to the draw list of the next Render, which only keeps a pointer to it, so it has to stay alive until then
+		void Draw(Mesh& mesh, const Matrix& worldMatrix);
+
 		void ToggleFinalColor();
 		void ToggleRotation();
 		void ToggleNormalMap();
 		void CycleLightingMode();
+		void CycleShadingMode();
+		void ToggleSIMD();
+		void ToggleMSAA();
+		void ToggleOcclusionCulling();
+		void ToggleMeshletCulling();
+		void ToggleMeshOptimization();
+		void ToggleTiledLayout();
+		void CycleShadingRateMode();
+		void ToggleDynamicResolution();
+		void SetTargetFrameTime(float seconds);
+		void CycleThreadCount();
+		void SetThreadCount(uint32_t threadCount);
 		bool SaveBufferToImage() const;
 
+		//Sets the angle of the mesh around the Y axis, for repeatable views while the rotation is off
+		void SetRotation(float rotation);
+
+		//Counters of the last rendered frame
+		struct RenderStats
+		{
+			uint32_t culledTriangles{};
+			uint32_t clippedTriangles{};
+			uint32_t smallTriangles{};
+			uint32_t smallTrianglesCulled{};
+			uint32_t occludedMeshes{};
+			uint32_t offscreenMeshes{}; //Rejected by the occlusion test because their bounding box misses the screen
+			uint32_t meshlets{};
+			uint32_t offscreenMeshlets{};
+			uint32_t backFacingMeshlets{};
+			uint32_t transformedVertices{};
+
+			//Transform cache, counted per meshlet or per mesh without meshlets, misses that kept their normals and tangents only redid the positions
+			uint32_t transformCacheHits{};
+			uint32_t transformCacheMisses{};
+			uint32_t transformCachePositionMisses{};
+
+			//In the multithreaded path every tile counts the triangles it rejected on its own
+			uint32_t hiZRejectedTriangles{};
+			uint32_t hiZRejectedBlocks{};
+
+			//Samples that passed the depth test, every one of them beyond the visible ones was overdraw
+			uint32_t writtenSamples{};
+
+			RenderStats& operator+=(const RenderStats& stats);
+		};
+
+		const RenderStats& GetStats() const { return m_Stats; };
+		void PrintStats() const;
+
+		//True when nothing changed since the frame before, Render then only presented that frame again
+		bool IsLastFrameReused() const { return m_IsLastFrameReused; };
+
 	private:
 		SDL_Window* m_pWindow{};
 		Texture* m_pTexDiffuse{ nullptr };
@@ -42,21 +98,59 @@ namespace dae
 		Texture* m_pTexGloss{ nullptr };
 		Texture* m_pTexSpecular{ nullptr };
 		Mesh m_Mesh{};
+		const std::string m_MeshFilename{ "Resources/vehicle.obj" };
 		float m_Rotation{};
 
+		//Meshes to render in the next frame, emptied once it is done but it keeps its memory
+		std::vector<DrawCall> m_DrawList{};
+
 		SDL_Surface* m_pFrontBuffer{ nullptr };
 		SDL_Surface* m_pBackBuffer{ nullptr };
 		uint32_t* m_pBackBufferPixels{};
+		uint32_t* m_pRenderTargetPixels{};
+		uint32_t* m_pResolvePixels{}; //The back buffer when rendering at the window size, otherwise the render target that gets upscaled into it
 		Uint32 m_ClearColor{};
 		bool m_ShowFinalColor{ true };
 
+		//Render targets are stored tiled: tiles are contiguous, the 8x8 blocks inside a tile are in Morton order and rows of a block are linear
+		//Every block row is one SIMD group, and a tile never shares cache lines with another tile
+		//Samples are stored as planes, sample s of a pixel is m_TiledPixelCount * s further than the first one
+		//The color buffer is resolved into the linear back buffer once the frame is done
+		//The linear layout is only kept to compare against, a row then spans the tiles of a whole tile row
+		bool m_IsTiledLayout{ true };
+		int m_RowPitch{}; //Pixels from one row of a block to the next
+		int m_TiledPixelCount{};
+		uint32_t* m_pColorBufferPixels{};
 		float* m_pDepthBufferPixels{};
+		VisibilityPixel* m_pVisibilityBufferPixels{};
 
 		Camera m_Camera{};
 
+		//Render on demand, toggles that change the image mark the frame dirty and everything else it depends on is compared with the last rendered frame
+		bool m_IsDirty{ true };
+		bool m_IsLastFrameReused{ false };
+		Matrix m_LastViewMatrix{};
+		Matrix m_LastProjectionMatrix{};
+		std::vector<DrawCall> m_LastDrawList{};
+		Int2 m_LastWindowSize{};
+
+		//Render resolution, every buffer is allocated for the window size and rendering at a lower resolution only uses the first part of them
 		int m_Width{};
 		int m_Height{};
-		float m_AspectRatio{};
+		int m_WindowWidth{};
+		int m_WindowHeight{};
+		float m_AspectRatio{}; //Of the window, a scaled resolution rounds to whole pixels
+
+		//Dynamic resolution, the render resolution follows the smoothed frame time in steps, and waits a few frames after every change to see its effect
+		bool m_IsDynamicResolution{ false };
+		float m_TargetFrameTime{ 1.f / 60.f };
+		float m_AverageFrameTime{};
+		float m_ResolutionScale{ 1.f };
+		const float m_MinResolutionScale{ .5f };
+		const float m_ResolutionScaleStep{ .05f };
+		const float m_FrameTimeSmoothing{ .2f };
+		const int m_ResolutionSettleFrames{ 10 };
+		int m_FramesSinceResolutionChange{};
 
 		enum class LightingMode
 		{
@@ -68,26 +162,259 @@ namespace dae
 			End
 		};
 
+		enum class ShadingMode
+		{
+			Forward, //Shades while rasterizing
+			Deferred, //Rasterizes into the visibility buffer, then shades every visible pixel once
+			DepthPrepass, //Rasterizes depth only, then shades the pixels whose depth matches
+
+			End
+		};
+
+		//What the rasterizer writes for every pixel that passes the depth test
+		enum class RasterPass
+		{
+			Forward, //Shaded color
+			Visibility, //Triangle and barycentric weights
+			Depth, //Nothing but the depth
+			EqualDepth //Shaded color, only where the depth equals the stored depth, the depth buffer stays untouched
+		};
+
 		LightingMode m_LightingMode{ LightingMode::Combined };
+		ShadingMode m_ShadingMode{ ShadingMode::Forward };
 		bool m_IsRotating{ true };
 		bool m_IsNormalMap{ true };
 
+		//Clipping happens in homogeneous clip space, against the near plane and a guard band around the screen
+		//Inside the guard band, triangles crossing the screen edges are only scissored by the rasterizer
+		const float m_GuardBand{ 8.f };
+
+		enum ClipPlane : uint8_t
+		{
+			Left = 1 << 0,
+			Right = 1 << 1,
+			Bottom = 1 << 2,
+			Top = 1 << 3,
+			Near = 1 << 4,
+			Far = 1 << 5
+		};
+
+		//Multithreading (sort-middle: triangles are binned into screen tiles, tiles are rasterized in parallel)
+		ThreadPool* m_pThreadPool{ nullptr };
+		const int m_TileSize{ 64 };
+		int m_TileCountX{};
+		int m_TileCountY{};
+		std::vector<TriangleSetup> m_Triangles{};
+		std::vector<std::vector<uint32_t>> m_TileBins{};
+		std::vector<RenderStats> m_TileStats{};
+
+		//Vertices are transformed in parallel chunks, large enough to be worth a job and a multiple of 8 so the SIMD vertex stage never needs its scalar tail
+		const int m_VertexChunkSize{ 4096 };
+
+		//Rasterization works on 28.4 fixed point vertex positions
+		const int m_SubPixelBits{ 4 };
+		const int64_t m_SubPixelSteps{ 1 << m_SubPixelBits };
+
+		//SIMD rasterization, 8 pixels at a time with 32 bit edge values
+		//Edge values inside the rasterized rect have to stay clear of the clamped 32 bit range
+		bool m_IsAVX2Supported{ false };
+		bool m_IsSIMDEnabled{ false };
+		const int64_t m_MaxSIMDEdgeValue{ 1 << 29 };
+
+		//Multisampling, coverage and depth are tested per sample but every pixel is shaded once per triangle
+		//Rotated grid in sub pixel steps from the pixel center, a single sample sits in the center
+		static constexpr int m_MaxSampleCount{ 4 };
+		const Int2 m_SamplePositions[m_MaxSampleCount]{ { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+		const int64_t m_MaxSampleOffset{ 6 };
+		int m_SampleCount{ 1 };
+
+		//Triangles are traversed in aligned blocks, which are rejected or accepted as a whole when possible
+		//Must stay 8 pixels wide, every row of a block is one SIMD group
+		const int m_BlockSize{ 8 };
+
+		enum class BlockCoverage
+		{
+			Outside,
+			Partial,
+			Inside
+		};
+
+		//Triangles with a bounding box of at most this many pixels wide and high skip the block traversal
+		const int m_SmallTriangleSize{ 2 };
+
+		//Hierarchical depth buffer, nearest and farthest stored depth of every block and every tile
+		//Triangles or blocks that lie behind the farthest depth are rejected before touching any pixel
+		//Blocks are updated from what every triangle wrote, tiles once their bin is done
+		//In between the farthest depth of a tile only gets refreshed when the block that held it moved closer
+		int m_BlockCountX{};
+		int m_BlockCountY{};
+		float* m_pBlockMinDepth{};
+		float* m_pBlockMaxDepth{};
+		uint16_t* m_pBlockDepthSamples{}; //Samples of every block that hold a depth, the farthest depth stays FLT_MAX until all of them do
+		float* m_pTileMinDepth{};
+		float* m_pTileMaxDepth{};
+		uint8_t* m_pTileDepthBlocks{}; //Blocks of every tile with a farthest depth below FLT_MAX
+
+		//What a block kernel did to the depth buffer, enough to update the block without reading it back
+		struct DepthWrites
+		{
+			uint32_t samples{}; //Passed the depth test
+			uint32_t clearedSamples{}; //Of those, the ones that didn't hold a depth yet
+			float minDepth{ FLT_MAX }; //Nearest depth written
+			float maxReplacedDepth{}; //Farthest depth that got overwritten
+		};
+
+		RenderStats m_Stats{};
+
+		//Occlusion culling, occluders are rasterized into a coarse depth buffer and the bounding boxes of the other meshes are tested against it
+		//Coverage is kept per pixel but depth only per tile, a tile's coverage mask has to fit in 32 bits
+		bool m_IsOcclusionCulling{ true };
+		const int m_OcclusionTileWidth{ 8 };
+		const int m_OcclusionTileHeight{ 4 };
+		int m_OcclusionTileCountX{};
+		int m_OcclusionTileCountY{};
+		std::vector<OcclusionTile> m_OcclusionTiles{};
+
+		enum class MeshVisibility
+		{
+			Visible,
+			Offscreen, //The bounding box misses the screen
+			Occluded //The bounding box lies behind the occluders
+		};
+
+		//Meshlet culling, against the frustum with their bounding sphere and against the camera position with their normal cone
+		//Holds the meshlets of the mesh being processed that survived, the vertex stage and the submission only go through those
+		bool m_IsMeshletCulling{ true };
+		std::vector<uint32_t> m_VisibleMeshlets{};
+
+		//Visible meshlets of the mesh being processed that missed the transform cache
+		std::vector<MeshletWork> m_MeshletWork{};
+
+		//Variable rate shading, coverage and depth stay per pixel but the pixels of a coarse cell share one shading result per triangle
+		//The rate image holds the cell size of every block, cells are aligned inside their block
+		enum class ShadingRateMode
+		{
+			Full, //Every pixel gets shaded
+			Variance, //Blocks with little contrast in the previous frame get shaded coarser, so the rates lag one frame behind the view
+			Foveated, //Blocks farther from the center of the screen get shaded coarser
+
+			End
+		};
+
+		ShadingRateMode m_ShadingRateMode{ ShadingRateMode::Full };
+		uint8_t* m_pShadingRates{}; //1, 2 or 4 pixels wide and high cells
+		const int m_VarianceThresholds[2]{ 16, 64 }; //Luminance variance in 8 bit units below which a block is shaded at 4x4 and 2x2
+		const float m_FoveationRadii[2]{ .3f, .6f }; //Distance to the center in screen heights beyond which a block is shaded at 2x2 and 4x4
+
+		//A frame that changed the variance rates gets rendered once more with them, otherwise a still view would keep the rates of the frame before it
+		//A frame rendered for that reason alone doesn't ask for another one, so the rates can't keep a still view rendering
+		bool m_IsShadingRateStale{ false };
+		bool m_IsShadingRateRefresh{ false };
+
+		//Shading results of the cells of one block, at a rate of 2x2 a block has 16 cells
+		struct CoarseShading
+		{
+			uint32_t colors[16]{};
+			uint32_t triangleIndices[16]{};
+			uint32_t shadedCells{};
+		};
+
+		//Parses an OBJ into a triangle list mesh, reorders it when the mesh asks for it and builds its meshlets, bounds and vertex streams
+		void LoadMesh(const std::string& filename, Mesh& mesh) const;
+
 		//Render helper functions
-		void RenderMeshes(const std::vector<Mesh>& meshes);
-		bool FrustumCulling(const Vector4& v);
-		Vertex_Out NDCToRaster(const Vertex_Out& v);
-		bool Remap(float& value, float min, float max);
+		bool UpdateFrameState();
+		void UpdateResolutionScale(float frameTime);
+		void SetResolutionScale(float scale);
+		void SetRenderResolution(int width, int height);
+		void UpscaleRenderTarget();
+		void RenderDrawList();
+		void UpdateShadingRates();
+		uint8_t ComputeVarianceShadingRate(int blockLeft, int blockTop) const;
+		void TransformMesh(const DrawCall& draw);
+		void UpdateTransformCache(Mesh& mesh, const Matrix& worldMatrix) const;
+		void CullMeshlets(const DrawCall& draw);
+		void SubmitMesh(const Mesh& mesh);
+		void SubmitMeshTriangle(const Mesh& mesh, uint32_t i0, uint32_t i1, uint32_t i2);
+		static Vector4 GatherPosition(const Mesh& mesh, uint32_t index);
+		static Vertex_Out GatherVertex(const Mesh& mesh, uint32_t index, const Vector4& position);
+		void RasterizeOccluders();
+		void RasterizeOccluder(const TriangleSetup& triangle, const Int2& clipMin, const Int2& clipMax);
+
+		//Coverage of one sample over an occlusion tile, a bit per pixel, the AVX2 one only when the edge values fit in 32 bits
+		uint32_t ComputeOccluderCoverage(const TriangleSetup& triangle, int tileLeft, int tileTop, int64_t e0Sample, int64_t e1Sample, int64_t e2Sample) const;
+		uint32_t ComputeOccluderCoverageAVX2(const TriangleSetup& triangle, int tileLeft, int tileTop, int64_t e0Sample, int64_t e1Sample, int64_t e2Sample) const;
+
+		MeshVisibility ClassifyMesh(const DrawCall& draw) const;
+		void RasterizeTriangles(RasterPass pass);
+		void ShadeVisibilityBuffer();
+		void ResolveColorBuffer();
+		int PixelIndex(int px, int py) const;
+		Vertex_Out PerspectiveDivide(const Vertex_Out& v) const;
+		Vertex_Out NDCToRaster(const Vertex_Out& v) const;
+		bool Remap(float& value, float min, float max) const;
 
-		//Renders a single triangle
-		void RenderTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2);
+		//Culls and clips a clip space triangle, then sets up the resulting triangles for rasterization and bins them when rendering multithreaded
+		void SubmitTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2, CullMode cullMode);
+
+		//Face culling and the trivial frustum reject, which only need the clip space positions
+		//A triangle that isn't rejected but isn't front facing either has to be flipped before clipping
+		bool IsTriangleRejected(const Vector4& p0, const Vector4& p1, const Vector4& p2, CullMode cullMode, bool& isFrontFace);
+
+		//Clips a front facing triangle against the near plane and the guard band, then sets up and bins what is left
+		void ClipTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2);
+		void AddTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2);
+		static float ComputeWinding(const Vector4& p0, const Vector4& p1, const Vector4& p2);
+		static uint8_t ComputeOutcode(const Vector4& position, float guardBand);
+		static float ClipDistance(const Vector4& position, uint8_t plane, float guardBand);
+		static Vertex_Out LerpVertex(const Vertex_Out& v0, const Vertex_Out& v1, float t);
+		bool SetupTriangle(const Vertex_Out& v0, const Vertex_Out& v1, const Vertex_Out& v2, TriangleSetup& triangle) const;
+		EdgeFunction SetupEdge(int64_t x0, int64_t y0, int64_t x1, int64_t y1) const;
+		bool IsCoveringPixel(const TriangleSetup& triangle) const;
+		void RasterizeTriangle(RasterPass pass, uint32_t triangleIndex, const Int2& clipMin, const Int2& clipMax, RenderStats& stats) const;
+		template<RasterPass pass>
+		void RasterizeTriangle(uint32_t triangleIndex, const Int2& clipMin, const Int2& clipMax, RenderStats& stats) const;
+		template<RasterPass pass>
+		void RasterizeSmallTriangle(uint32_t triangleIndex, const Int2& clipMin, const Int2& clipMax, RenderStats& stats) const;
+		BlockCoverage ClassifyBlock(const TriangleSetup& triangle, int blockLeft, int blockTop) const;
+
+		//Both return what they wrote to the depth buffer, nothing in the equal depth pass
+		template<RasterPass pass>
+		DepthWrites RasterizeBlock(uint32_t triangleIndex, const Int2& blockMin, const Int2& blockMax, bool isFullyCovered, bool isDepthTestPassing) const;
+		template<RasterPass pass>
+		DepthWrites RasterizeBlockAVX2(uint32_t triangleIndex, int blockLeft, const Int2& blockMin, const Int2& blockMax, bool isFullyCovered, bool isDepthTestPassing) const;
+		template<RasterPass pass>
+		static bool IsBehind(float nearestDepth, float storedFarthestDepth);
+		void UpdateBlockDepth(int blockX, int blockY, const DepthWrites& writes) const;
+		void UpdateTileDepth(int tileX, int tileY) const;
+		static int32_t ClampEdge(int64_t value);
+		void SetupSampleOffsets(const TriangleSetup& triangle, int64_t* pE0, int64_t* pE1, int64_t* pE2) const;
+		Int2 GetSamplePosition(int sample) const;
+		int64_t GetSampleSpread() const;
+
+		//Interpolates the vertex attributes of a covered pixel and returns its final color
+		uint32_t ShadePixel(const TriangleSetup& triangle, float px, float py, float depthBuffer) const;
+
+		//Same, but pixels in a coarse cell of the rate image reuse the color their cell got for the same triangle
+		uint32_t ShadeCoarsePixel(uint32_t triangleIndex, int px, int py, float depthBuffer, CoarseShading& cells) const;
 
 		//Shades a single pixel
-		ColorRGB PixelShading(const Vertex_Out& v);
+		ColorRGB PixelShading(const Vertex_Out& v) const;
+
+		//Function that transforms the vertices from the mesh from World space to Clip space
+		void VertexTransformationFunction(Mesh& mesh, const Matrix& worldMatrix, TransformWork work = {}) const;
+		void VertexTransformationFunction(const std::vector<Vertex>& vertices_in, std::vector<Vertex_Out>& vertices_out, const Matrix& worldMatrix, TransformWork work = {}) const;
+
+		//Same, for meshes stored as streams, 8 vertices at a time when SIMD is enabled
+		void VertexTransformationFunction(const VertexStreams& streams_in, VertexStreams& streams_out, const Matrix& worldMatrix, TransformWork work = {}) const;
+
+		//Only transforms the vertices of the given meshlets
+		void VertexTransformationFunction(Mesh& mesh, const Matrix& worldMatrix, const std::vector<MeshletWork>& meshlets) const;
 
-		//Function that transforms the vertices from the mesh from World space to Screen space
-		void VertexTransformationFunction(Mesh& mesh) const;
-		void VertexTransformationFunction(std::vector<Mesh>& meshes) const;
-		void VertexTransformationFunction(const std::vector<Vertex>& vertices_in, std::vector<Vertex_Out>& vertices_out, const Matrix& worldMatrix) const;
+		//Transform the vertices in [begin, end), the SIMD kernel only takes a multiple of 8 vertices
+		void TransformVertices(const std::vector<Vertex>& vertices_in, std::vector<Vertex_Out>& vertices_out, const Matrix& worldMatrix, const Matrix& worldViewProjectionMatrix, size_t begin, size_t end, TransformWork work) const;
+		void TransformVertexStreams(const VertexStreams& streams_in, VertexStreams& streams_out, const Matrix& worldMatrix, const Matrix& worldViewProjectionMatrix, size_t begin, size_t end, TransformWork work) const;
+		void TransformVertexStreamsAVX2(const VertexStreams& streams_in, VertexStreams& streams_out, const Matrix& worldMatrix, const Matrix& worldViewProjectionMatrix, size_t begin, size_t end, TransformWork work) const;
 	};
 
 	//TODO: add seperate files for material/BRDF functions
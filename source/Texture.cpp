@@ -1,6 +1,7 @@
 #include "Texture.h"
 #include "Vector2.h"
 #include <SDL_image.h>
+#include <algorithm>
 #include <cassert>
 
 namespace dae
@@ -35,8 +36,9 @@ namespace dae
 		int width = m_pSurface->w;
 		int height = m_pSurface->h;
 		
-		int px = int(uv.x * width);
-		int py = int(uv.y * height);
+		//Clamp to the edge, MSAA shades partially covered pixels at the center which can lie outside the triangle
+		int px = std::clamp(int(uv.x * width), 0, width - 1);
+		int py = std::clamp(int(uv.y * height), 0, height - 1);
 
 		Uint8 r, g, b;
 		SDL_GetRGB(m_pSurfacePixels[px + (py * width)], m_pSurface->format, &r, &g, &b);
@@ -0,0 +1,95 @@
+#include "ThreadPool.h"
+using namespace dae;
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+{
+	if (threadCount < 1)
+		threadCount = 1;
+
+	m_Workers.reserve(threadCount - 1);
+	for (uint32_t i{ 1 }; i < threadCount; ++i)
+	{
+		m_Workers.emplace_back(&ThreadPool::WorkerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock{ m_Mutex };
+		m_IsQuitting = true;
+	}
+	m_WakeCondition.notify_all();
+
+	for (std::thread& worker : m_Workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::Dispatch(uint32_t count, JobFunction pFunction, const void* pJob)
+{
+	if (count == 0) return;
+
+	//Nothing to share the work with
+	if (m_Workers.empty() || count == 1)
+	{
+		for (uint32_t i{}; i < count; ++i)
+		{
+			pFunction(pJob, i);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock{ m_Mutex };
+		m_pJobFunction = pFunction;
+		m_pJob = pJob;
+		m_JobCount = count;
+		m_NextIndex.store(0, std::memory_order_relaxed);
+		m_BusyWorkers = uint32_t(m_Workers.size());
+		++m_Generation;
+	}
+	m_WakeCondition.notify_all();
+
+	//The calling thread helps out instead of idling
+	RunJobs();
+
+	//Wait until every worker left the current job, so the job can safely go out of scope
+	std::unique_lock<std::mutex> lock{ m_Mutex };
+	m_DoneCondition.wait(lock, [this]() { return m_BusyWorkers == 0; });
+	m_pJobFunction = nullptr;
+	m_pJob = nullptr;
+}
+
+void ThreadPool::RunJobs()
+{
+	for (uint32_t i{ m_NextIndex.fetch_add(1) }; i < m_JobCount; i = m_NextIndex.fetch_add(1))
+	{
+		m_pJobFunction(m_pJob, i);
+	}
+}
+
+void ThreadPool::WorkerLoop()
+{
+	uint64_t generation{};
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock{ m_Mutex };
+			m_WakeCondition.wait(lock, [this, generation]() { return m_IsQuitting || m_Generation != generation; });
+
+			if (m_IsQuitting) return;
+			generation = m_Generation;
+		}
+
+		RunJobs();
+
+		{
+			std::lock_guard<std::mutex> lock{ m_Mutex };
+			--m_BusyWorkers;
+		}
+		m_DoneCondition.notify_one();
+	}
+}
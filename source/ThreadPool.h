@@ -0,0 +1,56 @@
+#pragma once
+
+//Standard includes
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dae
+{
+	class ThreadPool final
+	{
+	public:
+		//threadCount includes the calling thread, so a pool of 1 runs everything inline
+		ThreadPool(uint32_t threadCount);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool(ThreadPool&&) noexcept = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		ThreadPool& operator=(ThreadPool&&) noexcept = delete;
+
+		uint32_t GetThreadCount() const { return uint32_t(m_Workers.size()) + 1; };
+
+		//Calls job(index) for every index in [0, count) and returns when all of them are done
+		//Indices are handed out dynamically, so the order in which they run is not defined
+		template<typename Job>
+		void ParallelFor(uint32_t count, const Job& job)
+		{
+			Dispatch(count, [](const void* pJob, uint32_t index) { (*static_cast<const Job*>(pJob))(index); }, &job);
+		}
+
+	private:
+		using JobFunction = void(*)(const void* pJob, uint32_t index);
+
+		std::vector<std::thread> m_Workers{};
+		std::mutex m_Mutex{};
+		std::condition_variable m_WakeCondition{};
+		std::condition_variable m_DoneCondition{};
+
+		JobFunction m_pJobFunction{ nullptr };
+		const void* m_pJob{ nullptr };
+		uint32_t m_JobCount{};
+		std::atomic<uint32_t> m_NextIndex{};
+
+		uint64_t m_Generation{};
+		uint32_t m_BusyWorkers{};
+		bool m_IsQuitting{ false };
+
+		void Dispatch(uint32_t count, JobFunction pFunction, const void* pJob);
+		void RunJobs();
+		void WorkerLoop();
+	};
+}
@@ -1,6 +1,9 @@
 #pragma once
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <fstream>
+#include <unordered_map>
 #include "Math.h"
 #include "DataTypes.h"
 
@@ -10,7 +13,38 @@ namespace dae
 {
 	namespace Utils
 	{
+		//Attributes of a face corner, corners with bitwise identical attributes share one vertex
+		//Compared by value rather than by OBJ index, exporters often write the same normal again for every face
+		struct OBJCorner
+		{
+			Vector3 position{};
+			Vector2 uv{};
+			Vector3 normal{};
+
+			bool operator==(const OBJCorner& corner) const
+			{
+				return std::memcmp(this, &corner, sizeof(OBJCorner)) == 0;
+			}
+		};
+		static_assert(sizeof(OBJCorner) == 8 * sizeof(float), "OBJCorner is compared and hashed bytewise, it can't have padding");
+
+		struct OBJCornerHash
+		{
+			//FNV-1a over the bytes of the attributes
+			size_t operator()(const OBJCorner& corner) const
+			{
+				const uint8_t* pBytes{ reinterpret_cast<const uint8_t*>(&corner) };
+				uint64_t hash{ 14695981039346656037ull };
+				for (size_t i{}; i < sizeof(OBJCorner); ++i)
+				{
+					hash = (hash ^ pBytes[i]) * 1099511628211ull;
+				}
+				return size_t(hash);
+			}
+		};
+
 		//Just parses vertices and indices
+		//Face corners with the same position, uv and normal share one vertex
 #pragma warning(push)
 #pragma warning(disable : 4505) //Warning unreferenced local function
 		static bool ParseOBJ(const std::string& filename, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, bool flipAxisAndWinding = true)
@@ -31,6 +65,8 @@ namespace dae
 			std::vector<Vector3> normals{};
 			std::vector<Vector2> UVs{};
 
+			std::unordered_map<OBJCorner, uint32_t, OBJCornerHash> cornerVertices{};
+
 			vertices.clear();
 			indices.clear();
 
@@ -76,15 +112,15 @@ namespace dae
 					//add the material index as attibute to the attribute array
 					//
 					// Faces or triangles
-					Vertex vertex{};
 					size_t iPosition, iTexCoord, iNormal;
 
 					uint32_t tempIndices[3];
 					for (size_t iFace = 0; iFace < 3; iFace++)
 					{
 						// OBJ format uses 1-based arrays
+						OBJCorner corner{};
 						file >> iPosition;
-						vertex.position = positions[iPosition - 1];
+						corner.position = positions[iPosition - 1];
 
 						if ('/' == file.peek())//is next in buffer ==  '/' ?
 						{
@@ -94,7 +130,7 @@ namespace dae
 							{
 								// Optional texture coordinate
 								file >> iTexCoord;
-								vertex.uv = UVs[iTexCoord - 1];
+								corner.uv = UVs[iTexCoord - 1];
 							}
 
 							if ('/' == file.peek())
@@ -103,13 +139,21 @@ namespace dae
 
 								// Optional vertex normal
 								file >> iNormal;
-								vertex.normal = normals[iNormal - 1];
+								corner.normal = normals[iNormal - 1];
 							}
 						}
 
-						vertices.push_back(vertex);
-						tempIndices[iFace] = uint32_t(vertices.size()) - 1;
-						//indices.push_back(uint32_t(vertices.size()) - 1);
+						//Only the first corner with these attributes creates a vertex
+						const auto [it, isNew] { cornerVertices.try_emplace(corner, uint32_t(vertices.size())) };
+						if (isNew)
+						{
+							Vertex vertex{};
+							vertex.position = corner.position;
+							vertex.uv = corner.uv;
+							vertex.normal = corner.normal;
+							vertices.push_back(vertex);
+						}
+						tempIndices[iFace] = it->second;
 					}
 
 					indices.push_back(tempIndices[0]);
@@ -146,7 +190,11 @@ namespace dae
 				const Vector3 edge1 = p2 - p0;
 				const Vector2 diffX = Vector2(uv1.x - uv0.x, uv2.x - uv0.x);
 				const Vector2 diffY = Vector2(uv1.y - uv0.y, uv2.y - uv0.y);
-				float r = 1.f / Vector2::Cross(diffX, diffY);
+
+				//Vertices are shared, a face without uv area would spoil the tangents of its neighbours
+				const float uvArea = Vector2::Cross(diffX, diffY);
+				if (uvArea == 0.f) continue;
+				float r = 1.f / uvArea;
 
 				Vector3 tangent = (edge0 * diffY.y - edge1 * diffY.x) * r;
 				vertices[index0].tangent += tangent;
@@ -157,7 +205,11 @@ namespace dae
 			//Fix the tangents per vertex now because we accumulated
 			for (auto& v : vertices)
 			{
-				v.tangent = Vector3::Reject(v.tangent, v.normal).Normalized();
+				//Vertices that only belong to faces without uv area get any tangent perpendicular to their normal
+				Vector3 tangent = Vector3::Reject(v.tangent, v.normal);
+				if (tangent.SqrMagnitude() == 0.f)
+					tangent = Vector3::Cross(v.normal, std::abs(v.normal.y) < .99f ? Vector3::UnitY : Vector3::UnitX);
+				v.tangent = tangent.Normalized();
 
 				if(flipAxisAndWinding)
 				{
@@ -171,6 +223,511 @@ namespace dae
 			return true;
 #endif
 		}
+
+		//Axis aligned bounding box of the vertex positions
+		static void ComputeBounds(const std::vector<Vertex>& vertices, Vector3& boundsMin, Vector3& boundsMax)
+		{
+			if (vertices.empty())
+			{
+				boundsMin = {};
+				boundsMax = {};
+				return;
+			}
+
+			boundsMin = vertices[0].position;
+			boundsMax = vertices[0].position;
+			for (const Vertex& v : vertices)
+			{
+				boundsMin = { std::min(boundsMin.x, v.position.x), std::min(boundsMin.y, v.position.y), std::min(boundsMin.z, v.position.z) };
+				boundsMax = { std::max(boundsMax.x, v.position.x), std::max(boundsMax.y, v.position.y), std::max(boundsMax.z, v.position.z) };
+			}
+		}
+
+		//Average number of vertices transformed per triangle of a triangle list, with a FIFO post-transform cache of cacheSize vertices
+		//Ranges from 3 when no vertex is ever reused down to about 0.5 for a regular grid
+		static float ComputeACMR(const std::vector<uint32_t>& indices, size_t vertexCount, size_t cacheSize = 16)
+		{
+			if (indices.size() < 3) return 0.f;
+
+			//Every vertex remembers when it entered the cache, it is still in there while fewer than cacheSize misses happened since
+			std::vector<size_t> cacheTimes(vertexCount, 0);
+			size_t misses{};
+			for (uint32_t index : indices)
+			{
+				if (cacheTimes[index] == 0 || misses - cacheTimes[index] >= cacheSize)
+				{
+					++misses;
+					cacheTimes[index] = misses;
+				}
+			}
+
+			return misses / float(indices.size() / 3);
+		}
+
+		//Reorders the triangles of a triangle list so their vertices stay in the post-transform cache for as long as possible
+		//Tom Forsyth's linear speed vertex cache optimisation: every vertex is scored on its position in a simulated LRU cache and on the number of triangles it has left,
+		//the next triangle is the best scoring one that uses a vertex in the cache
+		static void OptimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount)
+		{
+			constexpr int cacheSize{ 32 };
+			const size_t triangleCount{ indices.size() / 3 };
+			if (triangleCount == 0) return;
+
+			//Triangles that use every vertex, the ones still to be added come first in a vertex's range
+			std::vector<uint32_t> triangleOffsets(vertexCount + 1, 0);
+			for (uint32_t index : indices)
+			{
+				++triangleOffsets[index + 1];
+			}
+			for (size_t v{}; v < vertexCount; ++v)
+			{
+				triangleOffsets[v + 1] += triangleOffsets[v];
+			}
+
+			std::vector<uint32_t> vertexTriangles(triangleCount * 3);
+			std::vector<uint32_t> remainingTriangles(vertexCount, 0);
+			for (uint32_t t{}; t < triangleCount; ++t)
+			{
+				for (size_t corner{}; corner < 3; ++corner)
+				{
+					const uint32_t v{ indices[t * 3 + corner] };
+					vertexTriangles[triangleOffsets[v] + remainingTriangles[v]++] = t;
+				}
+			}
+
+			const auto scoreVertex = [](int cachePosition, uint32_t remaining)
+				{
+					if (remaining == 0) return -1.f;
+
+					//The vertices of the last triangle share one score, the order in which they were used doesn't matter
+					float score{};
+					if (cachePosition >= 0)
+					{
+						score = cachePosition < 3 ? .75f : powf(1.f - (cachePosition - 3) / float(cacheSize - 3), 1.5f);
+					}
+
+					//Vertices with few triangles left get finished first, so they don't have to come back into the cache later
+					return score + 2.f / sqrtf(float(remaining));
+				};
+
+			std::vector<int> cachePositions(vertexCount, -1);
+			std::vector<float> vertexScores(vertexCount);
+			for (size_t v{}; v < vertexCount; ++v)
+			{
+				vertexScores[v] = scoreVertex(-1, remainingTriangles[v]);
+			}
+
+			std::vector<float> triangleScores(triangleCount);
+			std::vector<bool> isTriangleAdded(triangleCount, false);
+			for (size_t t{}; t < triangleCount; ++t)
+			{
+				triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+			}
+
+			std::vector<uint32_t> optimizedIndices{};
+			optimizedIndices.reserve(triangleCount * 3);
+			std::vector<uint32_t> cache{};
+			std::vector<uint32_t> nextCache{};
+			size_t firstUnaddedTriangle{};
+			int64_t bestTriangle{ -1 };
+
+			while (optimizedIndices.size() < triangleCount * 3)
+			{
+				//No triangle left around the cache, continue with the first one that wasn't added yet
+				if (bestTriangle < 0)
+				{
+					while (isTriangleAdded[firstUnaddedTriangle]) ++firstUnaddedTriangle;
+					bestTriangle = int64_t(firstUnaddedTriangle);
+				}
+
+				const uint32_t* pTriangle{ &indices[size_t(bestTriangle) * 3] };
+				isTriangleAdded[size_t(bestTriangle)] = true;
+				nextCache.assign(pTriangle, pTriangle + 3);
+
+				for (size_t corner{}; corner < 3; ++corner)
+				{
+					//Swap the triangle out of the vertex's remaining ones
+					const uint32_t v{ pTriangle[corner] };
+					optimizedIndices.push_back(v);
+					uint32_t* pVertexTriangles{ &vertexTriangles[triangleOffsets[v]] };
+					const uint32_t last{ --remainingTriangles[v] };
+					for (uint32_t i{}; i < last; ++i)
+					{
+						if (pVertexTriangles[i] == uint32_t(bestTriangle))
+						{
+							std::swap(pVertexTriangles[i], pVertexTriangles[last]);
+							break;
+						}
+					}
+				}
+
+				//The vertices of the new triangle move to the front of the cache, the others move back
+				for (uint32_t v : cache)
+				{
+					if (v != pTriangle[0] && v != pTriangle[1] && v != pTriangle[2]) nextCache.push_back(v);
+				}
+				std::swap(cache, nextCache);
+
+				//Rescore every vertex that was or is in the cache, then every triangle they still have
+				for (size_t i{}; i < cache.size(); ++i)
+				{
+					const uint32_t v{ cache[i] };
+					cachePositions[v] = i < cacheSize ? int(i) : -1;
+					vertexScores[v] = scoreVertex(cachePositions[v], remainingTriangles[v]);
+				}
+
+				bestTriangle = -1;
+				float bestScore{ -1.f };
+				for (size_t i{}; i < cache.size() && i < cacheSize; ++i)
+				{
+					const uint32_t v{ cache[i] };
+					for (uint32_t j{}; j < remainingTriangles[v]; ++j)
+					{
+						const uint32_t t{ vertexTriangles[triangleOffsets[v] + j] };
+						triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+						if (triangleScores[t] > bestScore)
+						{
+							bestScore = triangleScores[t];
+							bestTriangle = t;
+						}
+					}
+				}
+
+				if (cache.size() > cacheSize) cache.resize(cacheSize);
+			}
+
+			indices = std::move(optimizedIndices);
+		}
+
+		//Reorders a cache optimized triangle list in clusters, the ones on the outside of the mesh facing away from its center go first
+		//They tend to be in front from any viewpoint, so more of the pixels behind them fail the depth test instead of getting shaded and overwritten
+		//Clusters end where the vertex cache started over anyway, and get split further as long as that keeps their ACMR within threshold times the original
+		//Sander et al., Fast Triangle Reordering for Vertex Locality and Reduced Overdraw
+		static void OptimizeOverdraw(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, float threshold = 1.05f)
+		{
+			constexpr size_t cacheSize{ 16 };
+			constexpr size_t minClusterSize{ 8 };
+			const size_t triangleCount{ indices.size() / 3 };
+			if (triangleCount == 0) return;
+
+			//Same FIFO cache as ComputeACMR, moving the miss count cacheSize ahead empties it
+			std::vector<size_t> cacheTimes(vertices.size(), 0);
+			size_t misses{ cacheSize };
+			const auto countMisses = [&](size_t t)
+				{
+					size_t triangleMisses{};
+					for (size_t corner{}; corner < 3; ++corner)
+					{
+						const uint32_t index{ indices[t * 3 + corner] };
+						if (cacheTimes[index] == 0 || misses - cacheTimes[index] >= cacheSize)
+						{
+							++misses;
+							++triangleMisses;
+							cacheTimes[index] = misses;
+						}
+					}
+					return triangleMisses;
+				};
+
+			//Hard boundaries, none of the vertices of the triangle were in the cache
+			std::vector<size_t> hardStarts{};
+			for (size_t t{}; t < triangleCount; ++t)
+			{
+				if (countMisses(t) == 3) hardStarts.push_back(t);
+			}
+			if (hardStarts.empty() || hardStarts[0] != 0) hardStarts.insert(hardStarts.begin(), 0);
+			hardStarts.push_back(triangleCount);
+
+			//Soft boundaries, the triangles since the last boundary get as few misses starting from an empty cache as the hard cluster did
+			std::vector<size_t> clusterStarts{};
+			for (size_t cluster{}; cluster + 1 < hardStarts.size(); ++cluster)
+			{
+				const size_t start{ hardStarts[cluster] };
+				const size_t end{ hardStarts[cluster + 1] };
+
+				misses += cacheSize;
+				size_t clusterMisses{};
+				for (size_t t{ start }; t < end; ++t)
+				{
+					clusterMisses += countMisses(t);
+				}
+				const float clusterThreshold{ threshold * clusterMisses / float(end - start) };
+
+				clusterStarts.push_back(start);
+				misses += cacheSize;
+				size_t softMisses{};
+				for (size_t t{ start }; t < end; ++t)
+				{
+					softMisses += countMisses(t);
+					const size_t softSize{ t + 1 - clusterStarts.back() };
+					if (t + 1 < end && softSize >= minClusterSize && softMisses / float(softSize) <= clusterThreshold)
+					{
+						clusterStarts.push_back(t + 1);
+						misses += cacheSize;
+						softMisses = 0;
+					}
+				}
+			}
+			clusterStarts.push_back(triangleCount);
+
+			//Area weighted centroids and normals, the vertex normals decide which side a triangle faces
+			const auto getTriangle = [&](size_t t, Vector3& centroid, Vector3& normal)
+				{
+					const Vertex& v0{ vertices[indices[t * 3]] };
+					const Vertex& v1{ vertices[indices[t * 3 + 1]] };
+					const Vertex& v2{ vertices[indices[t * 3 + 2]] };
+					const float area{ Vector3::Cross(v1.position - v0.position, v2.position - v0.position).Magnitude() * .5f };
+					centroid = (v0.position + v1.position + v2.position) * (area / 3.f);
+					const Vector3 normalSum{ v0.normal + v1.normal + v2.normal };
+					const float normalLength{ normalSum.Magnitude() };
+					normal = normalLength > 0.f ? normalSum * (area / normalLength) : Vector3{};
+					return area;
+				};
+
+			Vector3 meshCentroid{};
+			float meshArea{};
+			for (size_t t{}; t < triangleCount; ++t)
+			{
+				Vector3 centroid{};
+				Vector3 normal{};
+				meshArea += getTriangle(t, centroid, normal);
+				meshCentroid += centroid;
+			}
+			if (meshArea > 0.f) meshCentroid = meshCentroid / meshArea;
+
+			struct Cluster
+			{
+				size_t start{};
+				size_t end{};
+				float outwardDistance{};
+			};
+			std::vector<Cluster> clusters{};
+			for (size_t cluster{}; cluster + 1 < clusterStarts.size(); ++cluster)
+			{
+				Cluster c{ clusterStarts[cluster], clusterStarts[cluster + 1] };
+
+				Vector3 clusterCentroid{};
+				Vector3 clusterNormal{};
+				float clusterArea{};
+				for (size_t t{ c.start }; t < c.end; ++t)
+				{
+					Vector3 centroid{};
+					Vector3 normal{};
+					clusterArea += getTriangle(t, centroid, normal);
+					clusterCentroid += centroid;
+					clusterNormal += normal;
+				}
+
+				const float normalLength{ clusterNormal.Magnitude() };
+				if (clusterArea > 0.f && normalLength > 0.f)
+				{
+					c.outwardDistance = Vector3::Dot(clusterCentroid / clusterArea - meshCentroid, clusterNormal / normalLength);
+				}
+				clusters.push_back(c);
+			}
+
+			std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.outwardDistance > b.outwardDistance; });
+
+			std::vector<uint32_t> orderedIndices{};
+			orderedIndices.reserve(indices.size());
+			for (const Cluster& c : clusters)
+			{
+				orderedIndices.insert(orderedIndices.end(), indices.begin() + c.start * 3, indices.begin() + c.end * 3);
+			}
+			indices = std::move(orderedIndices);
+		}
+
+		//Reorders the vertices in the order the triangles first use them, so fetching them walks through memory
+		//Vertices that no triangle uses are dropped
+		static void OptimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+		{
+			std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+			std::vector<Vertex> orderedVertices{};
+			orderedVertices.reserve(vertices.size());
+
+			for (uint32_t& index : indices)
+			{
+				if (remap[index] == UINT32_MAX)
+				{
+					remap[index] = uint32_t(orderedVertices.size());
+					orderedVertices.push_back(vertices[index]);
+				}
+				index = remap[index];
+			}
+
+			vertices = std::move(orderedVertices);
+		}
+
+		//Bounding sphere around the center of the bounding box, and a cone around the normals of the triangles
+		//The normal of a triangle is the cross product of its edges in winding order, pointing out of the front face
+		static void ComputeMeshletBounds(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, Meshlet& meshlet)
+		{
+			Vector3 boundsMin{ vertices[meshlet.vertexOffset].position };
+			Vector3 boundsMax{ boundsMin };
+			for (uint32_t v{ meshlet.vertexOffset }; v < meshlet.vertexOffset + meshlet.vertexCount; ++v)
+			{
+				const Vector3& p{ vertices[v].position };
+				boundsMin = { std::min(boundsMin.x, p.x), std::min(boundsMin.y, p.y), std::min(boundsMin.z, p.z) };
+				boundsMax = { std::max(boundsMax.x, p.x), std::max(boundsMax.y, p.y), std::max(boundsMax.z, p.z) };
+			}
+
+			meshlet.center = (boundsMin + boundsMax) * .5f;
+			meshlet.radius = 0.f;
+			for (uint32_t v{ meshlet.vertexOffset }; v < meshlet.vertexOffset + meshlet.vertexCount; ++v)
+			{
+				meshlet.radius = std::max(meshlet.radius, (vertices[v].position - meshlet.center).Magnitude());
+			}
+
+			std::vector<Vector3> normals{};
+			normals.reserve(meshlet.indexCount / 3);
+			Vector3 axis{};
+			for (uint32_t i{ meshlet.indexOffset }; i < meshlet.indexOffset + meshlet.indexCount; i += 3)
+			{
+				const Vector3& p0{ vertices[indices[i]].position };
+				const Vector3& p1{ vertices[indices[i + 1]].position };
+				const Vector3& p2{ vertices[indices[i + 2]].position };
+				const Vector3 normal{ Vector3::Cross(p1 - p0, p2 - p0) };
+				const float length{ normal.Magnitude() };
+
+				//Degenerate triangles never get rasterized, they don't limit the cone
+				if (length == 0.f) continue;
+				normals.push_back(normal / length);
+				axis += normals.back();
+			}
+
+			meshlet.coneCutoff = 2.f;
+			const float axisLength{ axis.Magnitude() };
+			if (normals.empty() || axisLength == 0.f) return;
+			axis /= axisLength;
+
+			//Cones wider than about 84 degrees from their axis hardly ever cull anything
+			float minDot{ 1.f };
+			for (const Vector3& normal : normals)
+			{
+				minDot = std::min(minDot, Vector3::Dot(normal, axis));
+			}
+			if (minDot <= .1f) return;
+
+			//The apex lies far enough back along the axis to be behind the plane of every triangle
+			float apexDistance{};
+			size_t triangle{};
+			for (uint32_t i{ meshlet.indexOffset }; i < meshlet.indexOffset + meshlet.indexCount; i += 3)
+			{
+				const Vector3& p0{ vertices[indices[i]].position };
+				const Vector3 normal{ Vector3::Cross(vertices[indices[i + 1]].position - p0, vertices[indices[i + 2]].position - p0) };
+				if (normal.Magnitude() == 0.f) continue;
+
+				const Vector3& unitNormal{ normals[triangle++] };
+				apexDistance = std::max(apexDistance, Vector3::Dot(meshlet.center - p0, unitNormal) / Vector3::Dot(axis, unitNormal));
+			}
+
+			meshlet.coneApex = meshlet.center - axis * apexDistance;
+			meshlet.coneAxis = axis;
+			meshlet.coneCutoff = sqrtf(1.f - minDot * minDot);
+		}
+
+		//Splits a triangle list into meshlets of at most maxVertices vertices and maxTriangles triangles, in the order of the index buffer
+		//so the post-transform cache and overdraw order it was optimized for stays the order triangles get drawn in
+		//A meshlet also ends before a triangle that faces too far away from the ones in it, so its normal cone stays narrow enough to cull
+		//The vertices get rearranged so every meshlet owns a range of them, only vertices an earlier meshlet used already get copied into it
+		static void BuildMeshlets(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, std::vector<Meshlet>& meshlets, size_t maxVertices = 64, size_t maxTriangles = 124)
+		{
+			std::vector<Vertex> meshletVertices{};
+			meshletVertices.reserve(vertices.size());
+			std::vector<uint32_t> meshletIndices{};
+			meshletIndices.reserve(indices.size());
+			meshlets.clear();
+
+			//Index of every vertex inside the current meshlet
+			std::vector<uint32_t> localIndices(vertices.size(), UINT32_MAX);
+			std::vector<uint32_t> usedVertices{};
+
+			const auto finishMeshlet = [&]()
+				{
+					if (usedVertices.empty()) return;
+
+					Meshlet& meshlet{ meshlets.back() };
+					meshlet.vertexCount = uint32_t(usedVertices.size());
+					meshlet.indexCount = uint32_t(meshletIndices.size()) - meshlet.indexOffset;
+
+					for (uint32_t v : usedVertices)
+					{
+						meshletVertices.push_back(vertices[v]);
+						localIndices[v] = UINT32_MAX;
+					}
+					usedVertices.clear();
+				};
+
+			//Cones wider than this from the average normal of the meshlet so far hardly ever cull anything
+			const float minNormalDot{ .5f };
+			Vector3 normalSum{};
+
+			for (size_t i{}; i + 2 < indices.size(); i += 3)
+			{
+				size_t newVertices{};
+				for (size_t corner{}; corner < 3; ++corner)
+				{
+					if (localIndices[indices[i + corner]] == UINT32_MAX) ++newVertices;
+				}
+
+				//Degenerate triangles fit any meshlet
+				const Vector3& p0{ vertices[indices[i]].position };
+				const Vector3 normal{ Vector3::Cross(vertices[indices[i + 1]].position - p0, vertices[indices[i + 2]].position - p0) };
+				const bool isFacingAway{ normal.SqrMagnitude() > 0.f && normalSum.SqrMagnitude() > 0.f && Vector3::Dot(normal.Normalized(), normalSum.Normalized()) < minNormalDot };
+
+				if (meshlets.empty() || (meshletIndices.size() - meshlets.back().indexOffset) / 3 >= maxTriangles || usedVertices.size() + newVertices > maxVertices || isFacingAway)
+				{
+					finishMeshlet();
+					meshlets.push_back(Meshlet{ uint32_t(meshletVertices.size()), 0, uint32_t(meshletIndices.size()) });
+					normalSum = {};
+				}
+
+				if (normal.SqrMagnitude() > 0.f) normalSum += normal.Normalized();
+				for (size_t corner{}; corner < 3; ++corner)
+				{
+					const uint32_t v{ indices[i + corner] };
+					if (localIndices[v] == UINT32_MAX)
+					{
+						localIndices[v] = uint32_t(usedVertices.size());
+						usedVertices.push_back(v);
+					}
+					meshletIndices.push_back(meshlets.back().vertexOffset + localIndices[v]);
+				}
+			}
+			finishMeshlet();
+
+			vertices = std::move(meshletVertices);
+			indices = std::move(meshletIndices);
+
+			for (Meshlet& meshlet : meshlets)
+			{
+				ComputeMeshletBounds(vertices, indices, meshlet);
+			}
+		}
+
+		//Copies the positions, normals and tangents into streams
+		static void BuildVertexStreams(const std::vector<Vertex>& vertices, VertexStreams& streams)
+		{
+			std::vector<float>* pStreams[9]{ &streams.positionX, &streams.positionY, &streams.positionZ, &streams.normalX, &streams.normalY, &streams.normalZ, &streams.tangentX, &streams.tangentY, &streams.tangentZ };
+			for (std::vector<float>* pStream : pStreams)
+			{
+				pStream->assign(vertices.size(), 0.f);
+			}
+			streams.positionW.clear();
+
+			for (size_t i{}; i < vertices.size(); ++i)
+			{
+				streams.positionX[i] = vertices[i].position.x;
+				streams.positionY[i] = vertices[i].position.y;
+				streams.positionZ[i] = vertices[i].position.z;
+				streams.normalX[i] = vertices[i].normal.x;
+				streams.normalY[i] = vertices[i].normal.y;
+				streams.normalZ[i] = vertices[i].normal.z;
+				streams.tangentX[i] = vertices[i].tangent.x;
+				streams.tangentY[i] = vertices[i].tangent.y;
+				streams.tangentZ[i] = vertices[i].tangent.z;
+			}
+		}
 #pragma warning(pop)
 	}
 }
\ No newline at end of file
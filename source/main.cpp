@@ -5,7 +5,21 @@
 #undef main
 
 //Standard includes
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <new>
+#include <thread>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 //Project includes
 #include "Timer.h"
@@ -19,15 +33,190 @@ void ShutDown(SDL_Window* pWindow)
 	SDL_Quit();
 }
 
-int main(int argc, char* args[])
+#ifdef _DEBUG
+//Debug builds count every allocation of the process, so the benchmark can check that a frame doesn't make any once its buffers are big enough
+//The array and sized forms end up here as well
+std::atomic<size_t> g_AllocationCount{ 0 };
+
+void* operator new(size_t size)
+{
+	++g_AllocationCount;
+	if (void* pMemory = std::malloc(size > 0 ? size : 1))
+		return pMemory;
+	throw std::bad_alloc{};
+}
+
+void operator delete(void* pMemory) noexcept
+{
+	std::free(pMemory);
+}
+#endif
+
+//Hardware counter of the cache misses of this process, threads started after it was opened are counted as well
+//Only Linux can read it without an external profiler, everywhere else it stays unavailable
+class CacheMissCounter final
+{
+public:
+	CacheMissCounter()
+	{
+#ifdef __linux__
+		perf_event_attr attributes{};
+		attributes.type = PERF_TYPE_HARDWARE;
+		attributes.size = sizeof(perf_event_attr);
+		attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+		attributes.disabled = 1;
+		attributes.inherit = 1;
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		m_FileDescriptor = int(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#endif
+	}
+	~CacheMissCounter()
+	{
+#ifdef __linux__
+		if (IsAvailable())
+			close(m_FileDescriptor);
+#endif
+	}
+
+	CacheMissCounter(const CacheMissCounter&) = delete;
+	CacheMissCounter(CacheMissCounter&&) noexcept = delete;
+	CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+	CacheMissCounter& operator=(CacheMissCounter&&) noexcept = delete;
+
+	bool IsAvailable() const { return m_FileDescriptor >= 0; };
+
+	void Start()
+	{
+#ifdef __linux__
+		if (!IsAvailable())
+			return;
+		ioctl(m_FileDescriptor, PERF_EVENT_IOC_RESET, 0);
+		ioctl(m_FileDescriptor, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+
+	//Returns the misses since Start
+	uint64_t Stop()
+	{
+		uint64_t count = 0;
+#ifdef __linux__
+		if (!IsAvailable())
+			return count;
+		ioctl(m_FileDescriptor, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(m_FileDescriptor, &count, sizeof(count)) != sizeof(count))
+			count = 0;
+#endif
+		return count;
+	}
+
+private:
+	int m_FileDescriptor = -1;
+};
+
+//Renders turns of the mesh at 1080p and at 4K, in the tiled and in the linear render target layout, on one thread and on all of them
+//Every run renders the same views, so the results can be compared between builds
+//The window stays hidden, without a display run it with SDL_VIDEODRIVER=dummy
+//In debug builds it doubles as the check that the per frame path stays free of heap allocations
+int RunBenchmark()
 {
-	//Unreferenced parameters
-	(void)argc;
-	(void)args;
+	const int frameCount = 60;
+	const int warmupFrameCount = 5;
+	const int turnCount = 3;
+	const int resolutions[2][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	const uint32_t maxThreadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+	for (const auto& resolution : resolutions)
+	{
+		SDL_Window* pWindow = SDL_CreateWindow(
+			"Rasterizer - Benchmark",
+			SDL_WINDOWPOS_UNDEFINED,
+			SDL_WINDOWPOS_UNDEFINED,
+			resolution[0], resolution[1], SDL_WINDOW_HIDDEN);
+
+		if (!pWindow)
+			return 1;
 
+		const auto pRenderer = new Renderer(pWindow);
+
+		//Every frame sets its own angle instead
+		pRenderer->ToggleRotation();
+
+		for (int run = 0; run < (maxThreadCount > 1 ? 2 : 1); ++run)
+		{
+			const uint32_t threadCount = run == 0 ? 1 : maxThreadCount;
+
+
+			for (int layout = 0; layout < 2; ++layout)
+			{
+				//Opened before the thread pool gets created, so its threads inherit the counter
+				CacheMissCounter cacheMissCounter{};
+				pRenderer->SetThreadCount(threadCount);
+
+				for (int frame = 0; frame < warmupFrameCount; ++frame)
+				{
+					pRenderer->SetRotation(PI * 2.f * (frameCount - warmupFrameCount + frame) / frameCount);
+					pRenderer->Render();
+				}
+
+				//Only the fastest turn counts, the others were slowed down by something else running
+				double bestDuration = 0.0;
+				uint64_t cacheMisses = 0;
+				for (int turn = 0; turn < turnCount; ++turn)
+				{
+#ifdef _DEBUG
+					const size_t allocationCount = g_AllocationCount;
+#endif
+					cacheMissCounter.Start();
+					const auto start = std::chrono::steady_clock::now();
+					for (int frame = 0; frame < frameCount; ++frame)
+					{
+						pRenderer->SetRotation(PI * 2.f * frame / frameCount);
+						pRenderer->Render();
+					}
+					const std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+					const uint64_t turnCacheMisses = cacheMissCounter.Stop();
+
+#ifdef _DEBUG
+					//The later turns render views the first one rendered already, every buffer and list has its capacity by then,
+					//including the copy of the draw list the next frame gets compared to
+					assert((turn == 0 || g_AllocationCount == allocationCount) && "A frame allocated memory after its buffers were big enough");
+#endif
+
+					if (turn == 0 || duration.count() < bestDuration)
+					{
+						bestDuration = duration.count();
+						cacheMisses = turnCacheMisses;
+					}
+				}
+
+				std::cout << resolution[0] << "x" << resolution[1] << ", " << threadCount << (threadCount == 1 ? " thread, " : " threads, ")
+					<< (layout == 0 ? "tiled" : "linear") << ": " << bestDuration / frameCount << " ms per frame, ";
+				if (cacheMissCounter.IsAvailable())
+					std::cout << cacheMisses / frameCount << " cache misses per frame" << std::endl;
+				else
+					std::cout << "cache misses not available" << std::endl;
+
+				pRenderer->ToggleTiledLayout();
+			}
+		}
+
+		delete pRenderer;
+		SDL_DestroyWindow(pWindow);
+	}
+
+	SDL_Quit();
+	return 0;
+}
+
+int main(int argc, char* args[])
+{
 	//Create window + surfaces
 	SDL_Init(SDL_INIT_VIDEO);
 
+	if (argc > 1 && std::strcmp(args[1], "--benchmark") == 0)
+		return RunBenchmark();
+
 	const uint32_t width = 640;
 	const uint32_t height = 480;
 
@@ -63,6 +252,12 @@ int main(int argc, char* args[])
 			case SDL_KEYUP:
 				if (e.key.keysym.scancode == SDL_SCANCODE_X)
 					takeScreenshot = true;
+				if (e.key.keysym.scancode == SDL_SCANCODE_F1)
+					pRenderer->ToggleDynamicResolution();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F2)
+					pRenderer->CycleShadingRateMode();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F3)
+					pRenderer->ToggleOcclusionCulling();
 				if (e.key.keysym.scancode == SDL_SCANCODE_F4)
 					pRenderer->ToggleFinalColor();
 				if (e.key.keysym.scancode == SDL_SCANCODE_F5)
@@ -71,6 +266,20 @@ int main(int argc, char* args[])
 					pRenderer->ToggleNormalMap();
 				if (e.key.keysym.scancode == SDL_SCANCODE_F7)
 					pRenderer->CycleLightingMode();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F8)
+					pRenderer->CycleThreadCount();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F9)
+					pRenderer->ToggleSIMD();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F10)
+					pRenderer->CycleShadingMode();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F11)
+					pRenderer->ToggleMSAA();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F12)
+					pRenderer->ToggleMeshletCulling();
+				if (e.key.keysym.scancode == SDL_SCANCODE_O)
+					pRenderer->ToggleMeshOptimization();
+				if (e.key.keysym.scancode == SDL_SCANCODE_L)
+					pRenderer->ToggleTiledLayout();
 				break;
 			}
 		}
@@ -81,6 +290,10 @@ int main(int argc, char* args[])
 		//--------- Render ---------
 		pRenderer->Render();
 
+		//Nothing changed, don't spin at full speed while waiting for input
+		if (pRenderer->IsLastFrameReused())
+			SDL_Delay(1);
+
 		//--------- Timer ---------
 		pTimer->Update();
 		printTimer += pTimer->GetElapsed();
@@ -88,6 +301,7 @@ int main(int argc, char* args[])
 		{
 			printTimer = 0.f;
 			std::cout << "dFPS: " << pTimer->GetdFPS() << std::endl;
+			pRenderer->PrintStats();
 		}
 
 		//Save screenshot after full render